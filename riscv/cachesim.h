@@ -44,6 +44,7 @@ class cache_sim_t
   virtual cache_result access(uint64_t addr, size_t bytes, bool store);
   void print_stats(FILE *stat_log=stdout);
   void set_miss_handler(cache_sim_t* mh);
+  size_t get_linesz() { return linesz; }
 
   static cache_sim_t* construct(const char* config, const char* name);
   static void parse_config_string(const char* config, size_t *sets, size_t *ways, size_t *linesz); //Extracts sets ways and linesz from config string.
@@ -158,6 +159,20 @@ class cache_memtracer_t : public memtracer_t
 
  protected:
   cache_sim_t* cache;
+
+  // Access every line touched by [addr, addr + bytes). Traced accesses are
+  // at most 8 bytes, so a misaligned one touches at most two lines; a miss
+  // in the second line takes precedence over a hit in the first.
+  cache_result access(uint64_t addr, size_t bytes, bool store)
+  {
+    size_t linesz = cache->get_linesz();
+    uint64_t second = (addr + bytes - 1) & ~(uint64_t)(linesz - 1);
+    if (likely(second <= addr))
+      return cache->access(addr, bytes, store);
+    cache_result result = cache->access(addr, second - addr, store);
+    cache_result second_result = cache->access(second, addr + bytes - second, store);
+    return result == CACHE_HIT ? second_result : result;
+  }
 };
 
 //l2 cache subclass of memory tracer
@@ -176,7 +191,7 @@ class l2cache_sim_t : public cache_memtracer_t
   }
   trace_result trace(uint64_t addr, size_t bytes, access_type type)
   {
-    switch(cache->access(addr, bytes, type == STORE)) {
+    switch(access(addr, bytes, type == STORE)) {
       case CACHE_MISS:
         return LLC_MISS;
       case CACHE_HIT:
@@ -201,7 +216,7 @@ class icache_sim_t : public cache_memtracer_t
   {
     if (type == FETCH)
     {
-      switch(cache->access(addr, bytes, false)) {
+      switch(access(addr, bytes, false)) {
         case CACHE_MISS_MISS:
           return LLC_MISS;
         case CACHE_MISS_HIT:
@@ -227,7 +242,7 @@ class dcache_sim_t : public cache_memtracer_t
   {
     if (type == LOAD || type == STORE)
     {
-      switch(cache->access(addr, bytes, type == STORE)) {
+      switch(access(addr, bytes, type == STORE)) {
         case CACHE_MISS_MISS:
           return LLC_MISS;
         case CACHE_MISS_HIT:
@@ -1,9 +1,11 @@
 #include "devices.h"
 #include "processor.h"
+#include <algorithm>
 
 clint_t::clint_t(std::vector<processor_t*>& procs)
-  : procs(procs), mtimecmp(procs.size())
+  : procs(procs), mtime(0), mtimecmp(procs.size())
 {
+  update_timer_interrupts();
 }
 
 /* 0000 msip hart 0
@@ -23,10 +25,12 @@ clint_t::clint_t(std::vector<processor_t*>& procs)
 bool clint_t::load(reg_t addr, size_t len, uint8_t* bytes)
 {
   if (addr >= MSIP_BASE && addr + len <= MSIP_BASE + procs.size()*sizeof(msip_t)) {
-    std::vector<msip_t> msip(procs.size());
-    for (size_t i = 0; i < procs.size(); ++i)
-      msip[i] = !!(procs[i]->state.mip & MIP_MSIP);
-    memcpy(bytes, (uint8_t*)&msip[0] + addr - MSIP_BASE, len);
+    // msip is bit 0 of the first byte of each hart's register
+    for (size_t i = 0; i < len; i++) {
+      reg_t offset = addr - MSIP_BASE + i;
+      bytes[i] = offset % sizeof(msip_t) == 0 &&
+                 (procs[offset / sizeof(msip_t)]->state.mip & MIP_MSIP);
+    }
   } else if (addr >= MTIMECMP_BASE && addr + len <= MTIMECMP_BASE + procs.size()*sizeof(mtimecmp_t)) {
     memcpy(bytes, (uint8_t*)&mtimecmp[0] + addr - MTIMECMP_BASE, len);
   } else if (addr >= MTIME_BASE && addr + len <= MTIME_BASE + sizeof(mtime_t)) {
@@ -40,33 +44,51 @@ bool clint_t::load(reg_t addr, size_t len, uint8_t* bytes)
 bool clint_t::store(reg_t addr, size_t len, const uint8_t* bytes)
 {
   if (addr >= MSIP_BASE && addr + len <= MSIP_BASE + procs.size()*sizeof(msip_t)) {
-    std::vector<msip_t> msip(procs.size());
-    std::vector<msip_t> mask(procs.size(), 0);
-    memcpy((uint8_t*)&msip[0] + addr - MSIP_BASE, bytes, len);
-    memset((uint8_t*)&mask[0] + addr - MSIP_BASE, 0xff, len);
-    for (size_t i = 0; i < procs.size(); ++i) {
-      if (!(mask[i] & 0xFF)) continue;
-      procs[i]->state.mip &= ~MIP_MSIP;
-      if (!!(msip[i] & 1))
-        procs[i]->state.mip |= MIP_MSIP;
+    for (size_t i = 0; i < len; i++) {
+      reg_t offset = addr - MSIP_BASE + i;
+      if (offset % sizeof(msip_t) != 0)
+        continue;
+      processor_t* proc = procs[offset / sizeof(msip_t)];
+      proc->state.mip &= ~MIP_MSIP;
+      if (bytes[i] & 1)
+        proc->state.mip |= MIP_MSIP;
     }
   } else if (addr >= MTIMECMP_BASE && addr + len <= MTIMECMP_BASE + procs.size()*sizeof(mtimecmp_t)) {
     memcpy((uint8_t*)&mtimecmp[0] + addr - MTIMECMP_BASE, bytes, len);
+    update_timer_interrupts();
   } else if (addr >= MTIME_BASE && addr + len <= MTIME_BASE + sizeof(mtime_t)) {
     memcpy((uint8_t*)&mtime + addr - MTIME_BASE, bytes, len);
+    update_timer_interrupts();
   } else {
     return false;
   }
-  increment(0);
   return true;
 }
 
+// Until mtime reaches the earliest mtimecmp that has not been reached yet,
+// no timer interrupt changes, so there is nothing to do but count.
 void clint_t::increment(reg_t inc)
 {
   mtime += inc;
+  if (mtime >= next_deadline)
+    update_timer_interrupts();
+}
+
+void clint_t::update_timer_interrupts()
+{
+  next_deadline = -1;
   for (size_t i = 0; i < procs.size(); i++) {
-    procs[i]->state.mip &= ~MIP_MTIP;
-    if (mtime >= mtimecmp[i])
+    if (mtime >= mtimecmp[i]) {
       procs[i]->state.mip |= MIP_MTIP;
+    } else {
+      procs[i]->state.mip &= ~MIP_MTIP;
+      next_deadline = std::min(next_deadline, mtimecmp[i]);
+    }
   }
 }
+
+void clint_t::hart_reset(size_t i)
+{
+  if (mtime >= mtimecmp[i])
+    procs[i]->state.mip |= MIP_MTIP;
+}
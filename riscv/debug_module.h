@@ -100,6 +100,11 @@ class debug_module_t : public abstract_device_t
     // Called when one of the attached harts was reset.
     void proc_reset(unsigned id);
 
+    // Whether the hart waits in the debug ROM with no command to run.
+    bool hart_parked(unsigned id) {
+      return id < 1024 && halted[id] && !debug_rom_flags[id];
+    }
+
   private:
     static const unsigned datasize = 2;
     // Size of program_buffer in 32-bit words, as exposed to the rest of the
@@ -178,13 +178,17 @@ private:
 #define JUMP_TARGET (pc + insn.uj_imm())
 #define RM ({ int rm = insn.rm(); \
               if(rm == 7) rm = STATE.frm; \
-              if(rm > 4) throw trap_illegal_instruction(0); \
+              if(rm > 4) raise_trap(CAUSE_ILLEGAL_INSTRUCTION, 0); \
               rm; })
 
 #define get_field(reg, mask) (((reg) & (decltype(reg))(mask)) / ((mask) & ~((mask) << 1)))
 #define set_field(reg, mask, val) (((reg) & ~(decltype(reg))(mask)) | (((decltype(reg))(val) * ((mask) & ~((mask) << 1))) & (decltype(reg))(mask)))
 
-#define require(x) if (unlikely(!(x))) throw trap_illegal_instruction(0)
+// End the instruction with a synchronous trap. The trap is recorded and taken
+// by the step loop once the instruction returns, see PC_PENDING_TRAP.
+#define raise_trap(cause, tval) return p->set_pending_trap((cause), (tval), pc)
+
+#define require(x) if (unlikely(!(x))) raise_trap(CAUSE_ILLEGAL_INSTRUCTION, 0)
 #define require_privilege(p) require(STATE.prv >= (p))
 #define require_rv64 require(xlen == 64)
 #define require_rv32 require(xlen == 32)
@@ -225,6 +229,7 @@ private:
 #define PC_SERIALIZE_BEFORE 3
 #define PC_SERIALIZE_AFTER 5
 #define PC_SERIALIZE_WFI 7
+#define PC_PENDING_TRAP 9 // take the trap recorded in state_t
 #define invalid_pc(pc) ((pc) & 1)
 
 /* Convenience wrappers to simplify softfloat code sequences */
@@ -273,9 +278,24 @@ inline freg_t f128_negate(freg_t a)
   unsigned csr_priv = get_field((which), 0x300); \
   unsigned csr_read_only = get_field((which), 0xC00) == 3; \
   if (((write) && csr_read_only) || STATE.prv < csr_priv) \
-    throw trap_illegal_instruction(0); \
+    raise_trap(CAUSE_ILLEGAL_INSTRUCTION, 0); \
   (which); })
 
+#define READ_CSR(which) ({ bool csr_legal; \
+  reg_t csr_value = p->get_csr((which), &csr_legal); \
+  if (unlikely(!csr_legal)) raise_trap(CAUSE_ILLEGAL_INSTRUCTION, 0); \
+  csr_value; })
+
+// Loads and stores of instructions. A fault ends the instruction with the
+// fault as its pending trap.
+#define MMU_LOAD(type, addr) ({ type##_t mem_value; \
+  if (unlikely(!MMU.load_##type##_or_fault((addr), &mem_value, ENCLAVE_ID))) \
+    return p->set_pending_mem_fault(pc); \
+  mem_value; })
+#define MMU_STORE(type, addr, value) ({ \
+  if (unlikely(!MMU.store_##type##_or_fault((addr), (value), ENCLAVE_ID))) \
+    return p->set_pending_mem_fault(pc); })
+
 // Seems that 0x0 doesn't work.
 #define DEBUG_START             0x100
 #define DEBUG_END                 (0x1000 - 1)
@@ -0,0 +1,79 @@
+// See LICENSE for license details.
+// Copyright 2018-2020 Marno van der Maas
+
+#ifndef _RISCV_DECODE_CACHE_H
+#define _RISCV_DECODE_CACHE_H
+
+#include "decode.h"
+#include "common.h"
+#include <vector>
+#include <cassert>
+
+struct decode_cache_stats_t {
+  uint64_t hits;
+  uint64_t misses;
+};
+
+// A decoded-instruction store shared by the harts of a simulation, indexed
+// by physical address. Each hart keeps its own virtually tagged icache in
+// front of it, so instructions fetched by several harts are only decoded
+// once. Entries are tagged with the instruction bits as well as the address
+// and decoder configuration, so an entry for code that has since been
+// rewritten simply misses and is decoded again.
+class decode_cache_t
+{
+public:
+  decode_cache_t(size_t size) : entries(size)
+  {
+    assert(size > 0 && (size & (size - 1)) == 0);
+    flush();
+  }
+
+  inline insn_func_t lookup(reg_t paddr, insn_bits_t bits, reg_t config)
+  {
+    entry_t* entry = &entries[index(paddr)];
+    if (likely(entry->paddr == paddr && entry->bits == bits && entry->config == config)) {
+      stats.hits++;
+      return entry->func;
+    }
+    stats.misses++;
+    return NULL;
+  }
+
+  inline void insert(reg_t paddr, insn_bits_t bits, reg_t config, insn_func_t func)
+  {
+    entry_t* entry = &entries[index(paddr)];
+    entry->paddr = paddr;
+    entry->bits = bits;
+    entry->config = config;
+    entry->func = func;
+  }
+
+  void flush()
+  {
+    for (auto& entry : entries)
+      entry = {reg_t(-1), 0, 0, NULL};
+    stats = {0, 0};
+  }
+
+  size_t size() { return entries.size(); }
+  const decode_cache_stats_t& get_stats() { return stats; }
+
+private:
+  struct entry_t {
+    reg_t paddr;
+    insn_bits_t bits;
+    reg_t config;
+    insn_func_t func;
+  };
+
+  std::vector<entry_t> entries;
+  decode_cache_stats_t stats;
+
+  inline size_t index(reg_t paddr)
+  {
+    return (paddr / PC_ALIGN) & (entries.size() - 1);
+  }
+};
+
+#endif
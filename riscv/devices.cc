@@ -3,62 +3,144 @@
 
 #include "devices.h"
 #include "debug.h"
+#include <algorithm>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// alignment of the target memory mapping, so it can be backed by huge pages
+static const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+mem_t::mem_t(size_t size)
+{
+  len = size;
+  if (!size) {
+    throw std::runtime_error("zero bytes of target memory requested");
+  }
+
+  // Over-allocate so the start can be aligned to a huge page, then trim.
+  size_t map_size = size + HUGE_PAGE_SIZE;
+  char* map = (char*)mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (map == MAP_FAILED) {
+    throw std::runtime_error("couldn't allocate " + std::to_string(size) + " bytes of target memory");
+  }
+  size_t host_page_size = sysconf(_SC_PAGESIZE);
+  data = (char*)(((uintptr_t)map + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+  size_t mapped_len = (size + host_page_size - 1) & ~(host_page_size - 1);
+  if (data != map)
+    munmap(map, data - map);
+  if (map + map_size > data + mapped_len)
+    munmap(data + mapped_len, map + map_size - (data + mapped_len));
+
+#ifdef MADV_HUGEPAGE
+  madvise(data, mapped_len, MADV_HUGEPAGE);
+#endif
+}
+
+mem_t::~mem_t()
+{
+  size_t host_page_size = sysconf(_SC_PAGESIZE);
+  munmap(data, (len + host_page_size - 1) & ~(host_page_size - 1));
+}
+
+size_t mem_t::resident_size()
+{
+  size_t host_page_size = sysconf(_SC_PAGESIZE);
+  size_t pages = (len + host_page_size - 1) / host_page_size;
+  std::vector<unsigned char> residency(pages);
+  if (mincore(data, len, residency.data()) != 0)
+    return 0;
+
+  size_t resident = 0;
+  for (size_t i = 0; i < pages; i++)
+    if (residency[i] & 1)
+      resident++;
+  return resident * host_page_size;
+}
 
 void bus_t::add_device(reg_t addr, abstract_device_t* dev)
 {
-  // Searching devices via lower_bound/upper_bound
-  // implicitly relies on the underlying std::map
-  // container to sort the keys and provide ordered
-  // iteration over this sort, which it does. (python's
-  // SortedDict is a good analogy)
-  devices[addr] = dev;
+  add_region({addr, 0, dev, NULL});
+}
+
+void bus_t::add_mem(reg_t addr, mem_t* mem)
+{
+  add_region({addr, mem->size(), mem, mem->contents()});
+}
+
+void bus_t::add_region(bus_region_t region)
+{
+  auto it = std::lower_bound(regions.begin(), regions.end(), region.base,
+      [](const bus_region_t& r, reg_t base) { return r.base < base; });
+  if (it != regions.end() && it->base == region.base)
+    *it = region;
+  else
+    regions.insert(it, region);
+
+  // MMIO devices extend up to the next region, or the top of memory.
+  for (size_t i = 0; i < regions.size(); i++) {
+    if (!regions[i].is_ram()) {
+      reg_t end = i + 1 < regions.size() ? regions[i + 1].base : 0;
+      regions[i].size = end - regions[i].base;
+    }
+  }
+}
+
+const bus_region_t* bus_t::lookup(reg_t addr)
+{
+  // Find the region with the base address closest to but not above addr
+  // (price-is-right search), then check that it reaches addr.
+  auto it = std::upper_bound(regions.begin(), regions.end(), addr,
+      [](reg_t addr, const bus_region_t& r) { return addr < r.base; });
+  if (it == regions.begin())
+    return NULL;
+  --it;
+  // Addresses past the end of a RAM region still belong to it for MMIO
+  // purposes, where mem_t refuses the access.
+  return &*it;
 }
 
 bool bus_t::load(reg_t addr, size_t len, uint8_t* bytes)
 {
-  // Find the device with the base address closest to but
-  // less than addr (price-is-right search)
-  auto it = devices.upper_bound(addr);
-  if (devices.empty() || it == devices.begin()) {
-    // Either the bus is empty, or there weren't
-    // any items with a base address <= addr
+  const bus_region_t* region = lookup(addr);
+  if (!region)
     return false;
-  }
-  // Found at least one item with base address <= addr
-  // The iterator points to the device after this, so
-  // go back by one item.
-  it--;
-  return it->second->load(addr - it->first, len, bytes);
+  return region->dev->load(addr - region->base, len, bytes);
 }
 
 bool bus_t::store(reg_t addr, size_t len, const uint8_t* bytes)
 {
-  // See comments in bus_t::load
-  auto it = devices.upper_bound(addr);
-  if (devices.empty() || it == devices.begin()) {
+  const bus_region_t* region = lookup(addr);
+  if (!region)
     return false;
-  }
-  it--;
-  return it->second->store(addr - it->first, len, bytes);
+  return region->dev->store(addr - region->base, len, bytes);
 }
 
-std::pair<reg_t, abstract_device_t*> bus_t::find_device(reg_t addr)
+bool bus_t::hart_load(reg_t addr, size_t len, uint8_t* bytes, uint32_t hart_id, enclave_id_t enclave_id)
 {
-  // See comments in bus_t::load
-  abstract_device_t* tmpDevice = NULL;
-  reg_t tmpAddress = 0;
-  if (devices.empty()) {
+  const bus_region_t* region = lookup(addr);
+  if (!region)
+    return false;
+  return region->dev->hart_load(addr - region->base, len, bytes, hart_id, enclave_id);
+}
+
+bool bus_t::hart_store(reg_t addr, size_t len, const uint8_t* bytes, uint32_t hart_id, enclave_id_t enclave_id)
+{
+  const bus_region_t* region = lookup(addr);
+  if (!region)
+    return false;
+  return region->dev->hart_store(addr - region->base, len, bytes, hart_id, enclave_id);
+}
+
+bus_region_t bus_t::find_region(reg_t addr)
+{
+  const bus_region_t* region = lookup(addr);
+  if (!region || !region->contains(addr)) {
 #ifdef PRAESIDIO_DEBUG
-    fprintf(stderr, "devices.cc: Warning! devices list is empty.\n");
+    if (regions.empty())
+      fprintf(stderr, "devices.cc: Warning! devices list is empty.\n");
 #endif
-    return std::make_pair((reg_t) 0, (abstract_device_t *)NULL);
-  }
-  for(std::map<reg_t,abstract_device_t*>::iterator it = devices.begin(); it != devices.end(); ++it) {
-    if(addr >= tmpAddress && addr < it->first) {
-      return std::make_pair(tmpAddress, tmpDevice);
-    }
-    tmpAddress = it->first;
-    tmpDevice = it->second;
+    return {0, 0, NULL, NULL};
   }
-  return std::make_pair(tmpAddress, tmpDevice);
+  return *region;
 }
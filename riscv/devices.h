@@ -5,6 +5,7 @@
 #define _RISCV_DEVICES_H
 
 #include "decode.h"
+#include "enclave.h"
 #include <cstdlib>
 #include <string>
 #include <map>
@@ -16,6 +17,14 @@ class abstract_device_t {
  public:
   virtual bool load(reg_t addr, size_t len, uint8_t* bytes) = 0;
   virtual bool store(reg_t addr, size_t len, const uint8_t* bytes) = 0;
+  // accesses issued by a hart, for devices whose behaviour depends on the
+  // initiator; by default the initiator is ignored
+  virtual bool hart_load(reg_t addr, size_t len, uint8_t* bytes, uint32_t hart_id, enclave_id_t enclave_id) {
+    return load(addr, len, bytes);
+  }
+  virtual bool hart_store(reg_t addr, size_t len, const uint8_t* bytes, uint32_t hart_id, enclave_id_t enclave_id) {
+    return store(addr, len, bytes);
+  }
   virtual ~abstract_device_t() {}
   char* contents() {
     fprintf(stderr, "devices.h: ERROR contents() exiting.\n");
@@ -27,16 +36,40 @@ class abstract_device_t {
   }
 };
 
+class mem_t;
+
+// A device mapped at [base, base + size). RAM is classified when it is added
+// to the bus, so lookups can hand out host pointers without RTTI. MMIO
+// devices do not know their size and extend up to the next region.
+struct bus_region_t {
+  reg_t base;
+  reg_t size;
+  abstract_device_t* dev;
+  char* mem; // host backing store for RAM, NULL for MMIO devices
+
+  bool is_ram() const { return mem != NULL; }
+  bool contains(reg_t addr) const { return addr - base < size; }
+};
+
 class bus_t : public abstract_device_t {
  public:
   bool load(reg_t addr, size_t len, uint8_t* bytes);
   bool store(reg_t addr, size_t len, const uint8_t* bytes);
+  bool hart_load(reg_t addr, size_t len, uint8_t* bytes, uint32_t hart_id, enclave_id_t enclave_id);
+  bool hart_store(reg_t addr, size_t len, const uint8_t* bytes, uint32_t hart_id, enclave_id_t enclave_id);
   void add_device(reg_t addr, abstract_device_t* dev);
+  void add_mem(reg_t addr, mem_t* mem);
 
-  std::pair<reg_t, abstract_device_t*> find_device(reg_t addr);
+  // returns the region containing addr, or an empty region with a NULL
+  // device if there is none
+  bus_region_t find_region(reg_t addr);
 
  private:
-  std::map<reg_t, abstract_device_t*> devices;
+  // sorted by base address
+  std::vector<bus_region_t> regions;
+
+  void add_region(bus_region_t region);
+  const bus_region_t* lookup(reg_t addr);
 };
 
 class abstract_mem_t : public abstract_device_t {
@@ -55,18 +88,12 @@ class rom_device_t : public abstract_mem_t {
   bool store(reg_t addr, size_t len, const uint8_t* bytes);
 };
 
+// Target memory is an anonymous, lazily committed mapping: host pages are
+// only allocated when the target touches them, and transparent huge pages
+// are requested to cut host TLB misses.
 class mem_t : public abstract_mem_t {
  public:
-  mem_t(size_t size) {
-    len = size;
-    if (!size) {
-      throw std::runtime_error("zero bytes of target memory requested");
-    }
-    data = (char*)calloc(1, size);
-    if (!data) {
-      throw std::runtime_error("couldn't allocate " + std::to_string(size) + " bytes of target memory");
-    }
-  }
+  mem_t(size_t size);
   //This constructor initializes data with the content of initial_data up to length.
   mem_t(size_t size, size_t length, char *initial_data) : mem_t(size) {
     if(length <= size) {
@@ -79,10 +106,36 @@ class mem_t : public abstract_mem_t {
     }
   }
   mem_t(const mem_t& that) = delete;
-  ~mem_t() { free(data); }
+  ~mem_t();
 
   bool load(reg_t addr, size_t len, uint8_t* bytes) { return false; }
   bool store(reg_t addr, size_t len, const uint8_t* bytes) { return false; }
+
+  // number of bytes of this memory currently backed by host pages
+  size_t resident_size();
+};
+
+// The enclave mailboxes, one Message_t slot per hart. A hart always writes
+// its own slot, wherever in the first message it stores, and the source of
+// the message is set to the writing enclave. Reading the type of a message
+// addressed to the reading enclave invalidates it.
+class mailbox_t : public abstract_device_t {
+ public:
+  mailbox_t(size_t nharts);
+  // accesses without an initiator, e.g. from the debug module
+  bool load(reg_t addr, size_t len, uint8_t* bytes);
+  bool store(reg_t addr, size_t len, const uint8_t* bytes);
+  bool hart_load(reg_t addr, size_t len, uint8_t* bytes, uint32_t hart_id, enclave_id_t enclave_id);
+  bool hart_store(reg_t addr, size_t len, const uint8_t* bytes, uint32_t hart_id, enclave_id_t enclave_id);
+  size_t size() { return MAILBOX_SIZE; }
+  uint64_t get_loads() { return loads; }
+  uint64_t get_stores() { return stores; }
+  uint64_t get_invalidations() { return invalidations; }
+ private:
+  std::vector<Message_t> messages;
+  uint64_t loads;
+  uint64_t stores;
+  uint64_t invalidations;
 };
 
 class clint_t : public abstract_device_t {
@@ -92,6 +145,12 @@ class clint_t : public abstract_device_t {
   bool store(reg_t addr, size_t len, const uint8_t* bytes);
   size_t size() { return CLINT_SIZE; }
   void increment(reg_t inc);
+  reg_t get_mtime() { return mtime; }
+  // the mtime at which the next timer interrupt becomes pending, or -1 if
+  // there is none ahead
+  reg_t get_next_deadline() { return next_deadline; }
+  // set MTIP again after the reset of hart i cleared it
+  void hart_reset(size_t i);
  private:
   typedef uint64_t mtime_t;
   typedef uint64_t mtimecmp_t;
@@ -99,6 +158,8 @@ class clint_t : public abstract_device_t {
   std::vector<processor_t*>& procs;
   mtime_t mtime;
   std::vector<mtimecmp_t> mtimecmp;
+  mtime_t next_deadline; // smallest mtimecmp above mtime
+  void update_timer_interrupts();
 };
 
 #endif
@@ -6,6 +6,8 @@
 
 #include "decode.h"
 #include "../praesidio-software/lib/enclaveLibrary.h"
+#include <vector>
+#include <algorithm>
 
 #define NUM_OF_ENCLAVE_PAGES 3
 
@@ -15,4 +17,57 @@ struct page_tag_t
   enclave_id_t reader = ENCLAVE_INVALID_ID;
 };
 
+// Interface for components that cache page tags, e.g. the TLB of a hart. They
+// are told about every tag change so they can drop the stale state for just
+// the affected DRAM page.
+class page_tag_listener_t
+{
+ public:
+  virtual ~page_tag_listener_t() {}
+  virtual void page_tag_changed(size_t page_num) = 0;
+};
+
+// The tags of all DRAM pages, shared by all harts. Tags may only be changed
+// through set_owner and set_reader so that subscribers are kept coherent.
+class tag_directory_t
+{
+ public:
+  tag_directory_t(size_t num_pages) : tags(num_pages) {}
+
+  size_t size() { return tags.size(); }
+  const page_tag_t& get(size_t page_num) { return tags[page_num]; }
+
+  void set_owner(size_t page_num, enclave_id_t owner)
+  {
+    tags[page_num].owner = owner;
+    notify(page_num);
+  }
+
+  void set_reader(size_t page_num, enclave_id_t reader)
+  {
+    tags[page_num].reader = reader;
+    notify(page_num);
+  }
+
+  void subscribe(page_tag_listener_t* l)
+  {
+    listeners.push_back(l);
+  }
+
+  void unsubscribe(page_tag_listener_t* l)
+  {
+    listeners.erase(std::remove(listeners.begin(), listeners.end(), l), listeners.end());
+  }
+
+ private:
+  std::vector<page_tag_t> tags;
+  std::vector<page_tag_listener_t*> listeners;
+
+  void notify(size_t page_num)
+  {
+    for (auto l : listeners)
+      l->page_tag_changed(page_num);
+  }
+};
+
 #endif //_RISCV_ENCLAVE_H
@@ -4,6 +4,9 @@
 #include "processor.h"
 #include "mmu.h"
 #include "sim.h"
+#include "jit.h"
+#include "softfloat.h"
+#include "host_fp.h"
 #include <cassert>
 
 
@@ -78,13 +81,29 @@ static reg_t execute_insn(processor_t* p, reg_t pc, insn_fetch_t fetch)
 {
   commit_log_stash_privilege(p);
   reg_t npc = fetch.func(p, fetch.insn, pc);
-  if (npc != PC_SERIALIZE_BEFORE) {
+  if (npc != PC_SERIALIZE_BEFORE && npc != PC_PENDING_TRAP) {
     commit_log_print_insn(p->get_state(), pc, fetch.insn);
     p->update_histogram(pc);
   }
   return npc;
 }
 
+// Gives MXCSR to the hart for host_fp.h while it runs, and moves the flags
+// raised on the host to fflags when it stops, however it stops.
+class host_fp_scope_t
+{
+public:
+  host_fp_scope_t(processor_t* p) : p(p), host_mxcsr(host_fp_enter()) {}
+  ~host_fp_scope_t()
+  {
+    p->take_host_fp_flags();
+    host_fp_leave(host_mxcsr);
+  }
+private:
+  processor_t* p;
+  uint32_t host_mxcsr;
+};
+
 bool processor_t::slow_path()
 {
   return debug || state.single_step != state.STEP_NONE || state.dcsr.cause;
@@ -102,17 +121,26 @@ void processor_t::step(size_t n)
     }
   }
 
+  // SoftFloat's rounding mode and flags are per host thread, which other
+  // harts may have used since this hart last ran. The rounding mode is set by
+  // every instruction that rounds, the flags are cleared here.
+  softfloat_exceptionFlags = 0;
+  host_fp_scope_t host_fp(this);
+  unfinished_steps = 0;
+  stopped_at_wfi = false;
   while (n > 0) {
     size_t instret = 0;
     reg_t pc = state.pc;
     mmu_t* _mmu = mmu;
+    jit_t* _jit = histogram_enabled ? NULL : jit;
 
     #define advance_pc() \
      if (unlikely(invalid_pc(pc))) { \
        switch (pc) { \
          case PC_SERIALIZE_BEFORE: state.serialized = true; break; \
          case PC_SERIALIZE_AFTER: ++instret; break; \
-         case PC_SERIALIZE_WFI: n = ++instret; break; \
+         case PC_SERIALIZE_WFI: n = ++instret; stopped_at_wfi = true; break; \
+         case PC_PENDING_TRAP: take_pending_trap(); n = instret; break; \
          default: abort(); \
        } \
        pc = state.pc; \
@@ -155,58 +183,79 @@ void processor_t::step(size_t n)
 
         }
       }
+      else if (unlikely(_mmu->fetch_traced))
+      {
+        // With an instruction cache model attached every executed
+        // instruction has to be reported, so the decoded instructions are
+        // run one at a time instead of as basic blocks.
+        while (instret < n)
+        {
+          auto ic_entry = _mmu->access_icache(pc, enclave_id);
+          if(ic_entry == NULL) {
+#ifdef PRAESIDIO_DEBUG
+            fprintf(stderr, "execute.cc: trapping becuase instruction not found at pc 0x%016lx\n", pc);
+#endif
+            pc = set_pending_trap(CAUSE_ILLEGAL_INSTRUCTION, 0, pc);
+            advance_pc();
+          }
+          _mmu->trace_fetch(ic_entry);
+          pc = execute_insn(this, pc, ic_entry->data);
+          advance_pc();
+        }
+      }
       else while (instret < n)
       {
-        // This code uses a modified Duff's Device to improve the performance
-        // of executing instructions. While typical Duff's Devices are used
-        // for software pipelining, the switch statement below primarily
-        // benefits from separate call points for the fetch.func function call
-        // found in each execute_insn. This function call is an indirect jump
-        // that depends on the current instruction. By having an indirect jump
-        // dedicated for each icache entry, you improve the performance of the
-        // host's next address predictor. Each case in the switch statement
-        // allows for the program flow to contine to the next case if it
-        // corresponds to the next instruction in the program and instret is
-        // still less than n.
-        //
-        // According to Andrew Waterman's recollection, this optimization
-        // resulted in approximately a 2x performance increase.
-
-        // This figures out where to jump to in the switch statement
-        size_t idx = _mmu->icache_index(pc);
-
-        // This gets the cached decoded instruction from the MMU. If the MMU
-        // does not have the current pc cached, it will refill the MMU and
-        // return the correct entry. ic_entry->data.func is the C++ function
-        // corresponding to the instruction.
-        auto ic_entry = _mmu->access_icache(pc, enclave_id);
-        if(ic_entry == NULL) {
+        // Run a basic block: a straight-line run of decoded instructions
+        // that ends at the first one that may change control flow. Only the
+        // block's tag is checked, the instructions before the last one run
+        // back to back and instret is updated once per block.
+        auto block = _mmu->access_block(pc, enclave_id);
+        if(block == NULL) {
 #ifdef PRAESIDIO_DEBUG
-          fprintf(stderr, "execute.cc: throwing trap becuase instruction not found at pc 0x%016lx\n", pc);
+          fprintf(stderr, "execute.cc: trapping becuase instruction not found at pc 0x%016lx\n", pc);
 #endif
-          throw trap_illegal_instruction(0);
+          pc = set_pending_trap(CAUSE_ILLEGAL_INSTRUCTION, 0, pc);
+          advance_pc();
         }
 
-        // This macro is included in "icache.h" included within the switch
-        // statement below. The indirect jump corresponding to the instruction
-        // is located within the execute_insn() function call.
-        #define ICACHE_ACCESS(i) { \
-          insn_fetch_t fetch = ic_entry->data; \
-          pc = execute_insn(this, pc, fetch); \
-          ic_entry = ic_entry->next; \
-          if (i == mmu_t::ICACHE_ENTRIES-1) break; \
-          if (unlikely(ic_entry->tag != pc)) break; \
-          if (unlikely(instret+1 == n)) break; \
-          instret++; \
-          state.pc = pc; \
+        // Hot blocks run as host code when translated code exists for the
+        // current configuration. It stops early, with executed set to the
+        // number of instructions it completed, if an instruction needs the
+        // interpreter; the interpreter then continues from the pc returned.
+        if (_jit) {
+          if (block->jit && block->jit_length <= n - instret &&
+              xlen == 64 && state.misa == block->jit_misa) {
+            _jit->context.enclave_id = enclave_id;
+            pc = block->jit(&_jit->context);
+            state.pc = pc;
+            instret += _jit->context.executed;
+            if (_jit->context.executed > 0)
+              continue;
+          } else if (++block->executions == jit_t::HOT_THRESHOLD) {
+            _jit->translate(pc, block);
+          }
         }
 
-        // This switch statement implements the modified Duff's device as
-        // explained above.
-        switch (idx) {
-          // "icache.h" is generated by the gen_icache script
-          #include "icache.h"
+        size_t count = std::min(block->length, n - instret);
+        size_t i = 0;
+        try {
+          // a pending trap ends the block at the instruction that set it
+          for (; i + 1 < count; i++) {
+            pc = execute_insn(this, pc, block->insns[i]);
+            if (unlikely(pc == PC_PENDING_TRAP))
+              break;
+          }
+          if (likely(pc != PC_PENDING_TRAP)) {
+            // CSR accesses may read the pc of the executing instruction
+            state.pc = pc;
+            pc = execute_insn(this, pc, block->insns[i]);
+          }
+        } catch (...) {
+          // account for the instructions that completed before the trap
+          instret += i;
+          throw;
         }
+        instret += i;
 
         advance_pc();
       }
@@ -223,6 +272,7 @@ void processor_t::step(size_t n)
     }
     catch (trigger_matched_t& t)
     {
+      bool faulted = false;
       if (mmu->matched_trigger) {
         // This exception came from the MMU. That means the instruction hasn't
         // fully executed yet. We start it again, but this time it won't throw
@@ -231,25 +281,47 @@ void processor_t::step(size_t n)
 
         insn_fetch_t fetch = mmu->load_insn(pc, enclave_id);
         pc = execute_insn(this, pc, fetch);
-        advance_pc();
 
         delete mmu->matched_trigger;
         mmu->matched_trigger = NULL;
+
+        // The restarted instruction may still fault after the point the
+        // trigger matched at, e.g. on an MMIO store or on the second piece
+        // of a misaligned access. The fault is taken instead of the trigger.
+        if (pc == PC_PENDING_TRAP) {
+          take_pending_trap();
+          n = instret;
+          pc = state.pc;
+          faulted = true;
+        } else {
+          advance_pc();
+        }
       }
-      switch (state.mcontrol[t.index].action) {
-        case ACTION_DEBUG_MODE:
-          enter_debug_mode(DCSR_CAUSE_HWBP);
-          break;
-        case ACTION_DEBUG_EXCEPTION: {
-          mem_trap_t trap(CAUSE_BREAKPOINT, t.address);
-          take_trap(trap, pc);
-          break;
+      if (!faulted) {
+        switch (state.mcontrol[t.index].action) {
+          case ACTION_DEBUG_MODE:
+            enter_debug_mode(DCSR_CAUSE_HWBP);
+            break;
+          case ACTION_DEBUG_EXCEPTION: {
+            mem_trap_t trap(CAUSE_BREAKPOINT, t.address);
+            take_trap(trap, pc);
+            break;
+          }
+          default:
+            abort();
         }
-        default:
-          abort();
       }
     }
 
+    catch (concurrent_yield_t&)
+    {
+      // The instruction at pc has not had any effect. Stop here and leave
+      // the rest of the step to be run once the hart runs on its own.
+      state.pc = pc;
+      unfinished_steps = n - instret;
+      n = instret;
+    }
+
     state.minstret += instret;
     if(state.prv == PRV_S) {
       state.minstretpriv += instret;
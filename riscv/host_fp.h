@@ -0,0 +1,218 @@
+// See LICENSE for license details.
+// Copyright 2018-2020 Marno van der Maas
+
+#ifndef _RISCV_HOST_FP_H
+#define _RISCV_HOST_FP_H
+
+#include "common.h"
+#include "softfloat.h"
+#include "specialize.h"
+#include <stdint.h>
+#include <string.h>
+
+// Arithmetic of the F and D extensions on the host FPU. Each host_* function
+// has the signature of the SoftFloat function of the same name without the
+// prefix and uses softfloat_roundingMode like it does.
+//
+// On x86-64 the operation runs as a single SSE instruction unless an operand
+// is a NaN or the rounding mode is RMM, which leave the result to SoftFloat.
+// For all other operands SSE and RISC-V follow IEEE 754 the same way,
+// detecting tininess after rounding included, so results and flags match
+// SoftFloat's; a NaN result is replaced with the canonical NaN. Fused
+// multiply-adds only use the host when it is built with FMA support.
+//
+// The host's exception flags are not read back after every operation, which
+// would need an expensive MXCSR write to clear them each time. Instead, the
+// flags accumulate in MXCSR while a hart runs and are moved to its fflags by
+// host_fp_take_flags() whenever the hart stops running or its FP CSRs are
+// accessed, which are the only ways to observe them. Between host_fp_enter()
+// and host_fp_leave() MXCSR therefore belongs to the hart running on the
+// thread; outside of that, host_* functions always use SoftFloat.
+#if defined(__x86_64__) && defined(__SSE2__) && defined(__GNUC__)
+#define HOST_FP_ENABLED 1
+#endif
+
+#ifdef HOST_FP_ENABLED
+
+// MXCSR fields
+static const uint32_t HOST_FP_INVALID = 1 << 0;
+static const uint32_t HOST_FP_DIVBYZERO = 1 << 2;
+static const uint32_t HOST_FP_OVERFLOW = 1 << 3;
+static const uint32_t HOST_FP_UNDERFLOW = 1 << 4;
+static const uint32_t HOST_FP_INEXACT = 1 << 5;
+static const uint32_t HOST_FP_FLAGS = 0x3f;
+static const uint32_t HOST_FP_MASK_ALL = 0x3f << 7;
+static const uint32_t HOST_FP_ROUNDING = 3 << 13;
+// all exceptions masked, round to nearest even, no flush to zero
+static const uint32_t HOST_FP_GUEST_MXCSR = HOST_FP_MASK_ALL;
+
+// the MXCSR rounding control the running hart last used, or 0 outside of
+// host_fp_enter() and host_fp_leave()
+extern __thread __attribute__((tls_model("initial-exec"))) uint32_t host_fp_mode;
+
+inline uint32_t host_fp_get_mxcsr()
+{
+  uint32_t mxcsr;
+  asm volatile("stmxcsr %0" : "=m"(mxcsr));
+  return mxcsr;
+}
+
+inline void host_fp_set_mxcsr(uint32_t mxcsr)
+{
+  asm volatile("ldmxcsr %0" : : "m"(mxcsr));
+}
+
+// Switch MXCSR to the guest configuration. Returns the host's MXCSR.
+inline uint32_t host_fp_enter()
+{
+  uint32_t host_mxcsr = host_fp_get_mxcsr();
+  host_fp_set_mxcsr(HOST_FP_GUEST_MXCSR);
+  host_fp_mode = HOST_FP_GUEST_MXCSR | (1 << 31);
+  return host_mxcsr;
+}
+
+// Return the flags raised since the last call, as SoftFloat flags, and
+// clear them.
+inline uint_fast8_t host_fp_take_flags()
+{
+  if (!host_fp_mode)
+    return 0;
+  uint32_t mxcsr = host_fp_get_mxcsr();
+  if (!(mxcsr & HOST_FP_FLAGS))
+    return 0;
+  host_fp_set_mxcsr(mxcsr & ~HOST_FP_FLAGS);
+  return ((mxcsr & HOST_FP_INEXACT) ? softfloat_flag_inexact : 0) |
+         ((mxcsr & HOST_FP_UNDERFLOW) ? softfloat_flag_underflow : 0) |
+         ((mxcsr & HOST_FP_OVERFLOW) ? softfloat_flag_overflow : 0) |
+         ((mxcsr & HOST_FP_DIVBYZERO) ? softfloat_flag_infinite : 0) |
+         ((mxcsr & HOST_FP_INVALID) ? softfloat_flag_invalid : 0);
+}
+
+// Give MXCSR back to the host. Flags must have been taken before.
+inline void host_fp_leave(uint32_t host_mxcsr)
+{
+  host_fp_mode = 0;
+  host_fp_set_mxcsr(host_mxcsr);
+}
+
+// Select the host rounding mode for an operation. Returns false if the
+// operation has to use SoftFloat.
+inline bool host_fp_round(uint_fast8_t rm)
+{
+  uint32_t mode = host_fp_mode;
+  if (unlikely(!mode))
+    return false;
+  uint32_t rounding;
+  switch (rm) {
+    case softfloat_round_near_even: rounding = 0 << 13; break;
+    case softfloat_round_minMag: rounding = 3 << 13; break;
+    case softfloat_round_min: rounding = 1 << 13; break;
+    case softfloat_round_max: rounding = 2 << 13; break;
+    default: return false;
+  }
+  if (unlikely((mode & HOST_FP_ROUNDING) != rounding)) {
+    host_fp_mode = (mode & ~HOST_FP_ROUNDING) | rounding;
+    host_fp_set_mxcsr((host_fp_get_mxcsr() & ~HOST_FP_ROUNDING) | rounding);
+  }
+  return true;
+}
+
+inline bool host_fp_nan_f32(uint32_t v) { return (v & 0x7fffffff) > 0x7f800000; }
+inline bool host_fp_nan_f64(uint64_t v) { return (v & ~(uint64_t(1) << 63)) > (uint64_t(0x7ff) << 52); }
+
+// The SSE instructions are volatile asm like the MXCSR accesses, so the
+// compiler keeps them in order.
+#define HOST_FP_BINARY(prec, ctype, op, insn) \
+  inline float##prec##_t host_f##prec##_##op(float##prec##_t a, float##prec##_t b) \
+  { \
+    if (host_fp_nan_f##prec(a.v) || host_fp_nan_f##prec(b.v) || \
+        !host_fp_round(softfloat_roundingMode)) \
+      return f##prec##_##op(a, b); \
+    ctype x, y; \
+    memcpy(&x, &a.v, sizeof x); \
+    memcpy(&y, &b.v, sizeof y); \
+    asm volatile(insn " %1, %0" : "+x"(x) : "x"(y)); \
+    float##prec##_t r; \
+    memcpy(&r.v, &x, sizeof x); \
+    if (unlikely(host_fp_nan_f##prec(r.v))) \
+      r.v = defaultNaNF##prec##UI; \
+    return r; \
+  }
+
+HOST_FP_BINARY(32, float, add, "addss")
+HOST_FP_BINARY(32, float, sub, "subss")
+HOST_FP_BINARY(32, float, mul, "mulss")
+HOST_FP_BINARY(32, float, div, "divss")
+HOST_FP_BINARY(64, double, add, "addsd")
+HOST_FP_BINARY(64, double, sub, "subsd")
+HOST_FP_BINARY(64, double, mul, "mulsd")
+HOST_FP_BINARY(64, double, div, "divsd")
+
+#define HOST_FP_SQRT(prec, ctype, insn) \
+  inline float##prec##_t host_f##prec##_sqrt(float##prec##_t a) \
+  { \
+    if (host_fp_nan_f##prec(a.v) || !host_fp_round(softfloat_roundingMode)) \
+      return f##prec##_sqrt(a); \
+    ctype x; \
+    memcpy(&x, &a.v, sizeof x); \
+    asm volatile(insn " %0, %0" : "+x"(x)); \
+    float##prec##_t r; \
+    memcpy(&r.v, &x, sizeof x); \
+    if (unlikely(host_fp_nan_f##prec(r.v))) \
+      r.v = defaultNaNF##prec##UI; \
+    return r; \
+  }
+
+HOST_FP_SQRT(32, float, "sqrtss")
+HOST_FP_SQRT(64, double, "sqrtsd")
+
+#ifdef __FMA__
+// a * b + c as vfmadd213 a, b, c, i.e. a = b * a + c. NaN operands are left
+// to SoftFloat, so 0 * inf + qNaN raises invalid as RISC-V requires.
+#define HOST_FP_MULADD(prec, ctype, insn) \
+  inline float##prec##_t host_f##prec##_mulAdd(float##prec##_t a, float##prec##_t b, float##prec##_t c) \
+  { \
+    if (host_fp_nan_f##prec(a.v) || host_fp_nan_f##prec(b.v) || host_fp_nan_f##prec(c.v) || \
+        !host_fp_round(softfloat_roundingMode)) \
+      return f##prec##_mulAdd(a, b, c); \
+    ctype x, y, z; \
+    memcpy(&x, &a.v, sizeof x); \
+    memcpy(&y, &b.v, sizeof y); \
+    memcpy(&z, &c.v, sizeof z); \
+    asm volatile(insn " %2, %1, %0" : "+x"(x) : "x"(y), "x"(z)); \
+    float##prec##_t r; \
+    memcpy(&r.v, &x, sizeof x); \
+    if (unlikely(host_fp_nan_f##prec(r.v))) \
+      r.v = defaultNaNF##prec##UI; \
+    return r; \
+  }
+
+HOST_FP_MULADD(32, float, "vfmadd213ss")
+HOST_FP_MULADD(64, double, "vfmadd213sd")
+#else
+inline float32_t host_f32_mulAdd(float32_t a, float32_t b, float32_t c) { return f32_mulAdd(a, b, c); }
+inline float64_t host_f64_mulAdd(float64_t a, float64_t b, float64_t c) { return f64_mulAdd(a, b, c); }
+#endif
+
+#else // HOST_FP_ENABLED
+
+inline uint32_t host_fp_enter() { return 0; }
+inline uint_fast8_t host_fp_take_flags() { return 0; }
+inline void host_fp_leave(uint32_t host_mxcsr) {}
+
+inline float32_t host_f32_add(float32_t a, float32_t b) { return f32_add(a, b); }
+inline float32_t host_f32_sub(float32_t a, float32_t b) { return f32_sub(a, b); }
+inline float32_t host_f32_mul(float32_t a, float32_t b) { return f32_mul(a, b); }
+inline float32_t host_f32_div(float32_t a, float32_t b) { return f32_div(a, b); }
+inline float32_t host_f32_sqrt(float32_t a) { return f32_sqrt(a); }
+inline float32_t host_f32_mulAdd(float32_t a, float32_t b, float32_t c) { return f32_mulAdd(a, b, c); }
+inline float64_t host_f64_add(float64_t a, float64_t b) { return f64_add(a, b); }
+inline float64_t host_f64_sub(float64_t a, float64_t b) { return f64_sub(a, b); }
+inline float64_t host_f64_mul(float64_t a, float64_t b) { return f64_mul(a, b); }
+inline float64_t host_f64_div(float64_t a, float64_t b) { return f64_div(a, b); }
+inline float64_t host_f64_sqrt(float64_t a) { return f64_sqrt(a); }
+inline float64_t host_f64_mulAdd(float64_t a, float64_t b, float64_t c) { return f64_mulAdd(a, b, c); }
+
+#endif // HOST_FP_ENABLED
+
+#endif
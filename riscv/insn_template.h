@@ -5,5 +5,6 @@
 #include "softfloat.h"
 #include "internals.h"
 #include "specialize.h"
+#include "host_fp.h"
 #include "tracer.h"
 #include <assert.h>
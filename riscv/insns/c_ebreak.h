@@ -1,2 +1,2 @@
 require_extension('C');
-throw trap_breakpoint(pc);
+raise_trap(CAUSE_BREAKPOINT, pc);
@@ -1,2 +1,2 @@
 require_extension('C');
-WRITE_RVC_RS2S(MMU.load_int32(RVC_RS1S + insn.rvc_lw_imm(), ENCLAVE_ID));
+WRITE_RVC_RS2S(MMU_LOAD(int32, RVC_RS1S + insn.rvc_lw_imm()));
@@ -1,3 +1,3 @@
 require_extension('C');
 require(insn.rvc_rd() != 0);
-WRITE_RD(MMU.load_int32(RVC_SP + insn.rvc_lwsp_imm(), ENCLAVE_ID));
+WRITE_RD(MMU_LOAD(int32, RVC_SP + insn.rvc_lwsp_imm()));
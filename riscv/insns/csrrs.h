@@ -1,6 +1,6 @@
 bool write = insn.rs1() != 0;
 int csr = validate_csr(insn.csr(), write);
-reg_t old = p->get_csr(csr);
+reg_t old = READ_CSR(csr);
 if (write) {
   p->set_csr(csr, old | RS1);
 }
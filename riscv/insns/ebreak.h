@@ -1 +1 @@
-throw trap_breakpoint(pc);
+raise_trap(CAUSE_BREAKPOINT, pc);
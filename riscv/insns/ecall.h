@@ -1,7 +1,7 @@
 switch (STATE.prv)
 {
-  case PRV_U: throw trap_user_ecall();
-  case PRV_S: throw trap_supervisor_ecall();
-  case PRV_M: throw trap_machine_ecall();
+  case PRV_U: raise_trap(CAUSE_USER_ECALL, 0);
+  case PRV_S: raise_trap(CAUSE_SUPERVISOR_ECALL, 0);
+  case PRV_M: raise_trap(CAUSE_MACHINE_ECALL, 0);
   default: abort();
 }
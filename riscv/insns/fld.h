@@ -1,3 +1,3 @@
 require_extension('D');
 require_fp;
-WRITE_FRD(f64(MMU.load_uint64(RS1 + insn.i_imm(), ENCLAVE_ID)));
+WRITE_FRD(f64(MMU_LOAD(uint64, RS1 + insn.i_imm())));
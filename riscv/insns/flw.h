@@ -1,3 +1,3 @@
 require_extension('F');
 require_fp;
-WRITE_FRD(f32(MMU.load_uint32(RS1 + insn.i_imm(), ENCLAVE_ID)));
+WRITE_FRD(f32(MMU_LOAD(uint32, RS1 + insn.i_imm())));
@@ -1,3 +1,3 @@
 require_extension('D');
 require_fp;
-MMU.store_uint64(RS1 + insn.s_imm(), FRS2.v[0], ENCLAVE_ID);
+MMU_STORE(uint64, RS1 + insn.s_imm(), FRS2.v[0]);
@@ -1,3 +1,3 @@
 require_extension('F');
 require_fp;
-MMU.store_uint32(RS1 + insn.s_imm(), FRS2.v[0], ENCLAVE_ID);
+MMU_STORE(uint32, RS1 + insn.s_imm(), FRS2.v[0]);
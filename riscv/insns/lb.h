@@ -1 +1 @@
-WRITE_RD(MMU.load_int8(RS1 + insn.i_imm(), ENCLAVE_ID));
+WRITE_RD(MMU_LOAD(int8, RS1 + insn.i_imm()));
@@ -1 +1 @@
-WRITE_RD(MMU.load_uint8(RS1 + insn.i_imm(), ENCLAVE_ID));
+WRITE_RD(MMU_LOAD(uint8, RS1 + insn.i_imm()));
@@ -1,2 +1,2 @@
 require_rv64;
-WRITE_RD(MMU.load_int64(RS1 + insn.i_imm(), ENCLAVE_ID));
+WRITE_RD(MMU_LOAD(int64, RS1 + insn.i_imm()));
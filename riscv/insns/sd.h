@@ -1,2 +1,2 @@
 require_rv64;
-MMU.store_uint64(RS1 + insn.s_imm(), RS2, ENCLAVE_ID);
+MMU_STORE(uint64, RS1 + insn.s_imm(), RS2);
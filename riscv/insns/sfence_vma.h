@@ -1,2 +1,2 @@
 require_privilege(get_field(STATE.mstatus, MSTATUS_TVM) ? PRV_M : PRV_S);
-MMU.flush_tlb();
+MMU.sfence_vma(RS1, insn.rs1() == 0, RS2, insn.rs2() == 0);
@@ -1 +1 @@
-MMU.store_uint32(RS1 + insn.s_imm(), RS2, ENCLAVE_ID);
+MMU_STORE(uint32, RS1 + insn.s_imm(), RS2);
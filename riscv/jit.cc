@@ -0,0 +1,611 @@
+// See LICENSE for license details.
+// Copyright 2018-2020 Marno van der Maas
+
+#include "jit.h"
+#include "processor.h"
+#include "encoding.h"
+#include <cstddef>
+#include <cstring>
+#include <cassert>
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#define JIT_HOST_SUPPORTED 1
+#endif
+
+// Memory accesses of translated code. They return false, without side
+// effects, if the access does not hit in the TLB.
+template <typename T>
+static bool jit_load(jit_context_t* ctx, reg_t addr, reg_t* rd)
+{
+  T data;
+  if (!ctx->mmu->try_load(addr, sizeof(T), &data, ctx->enclave_id))
+    return false;
+  *rd = data;
+  return true;
+}
+
+template <typename T>
+static bool jit_store(jit_context_t* ctx, reg_t addr, reg_t value)
+{
+  T data = value;
+  return ctx->mmu->try_store(addr, sizeof(T), &data, ctx->enclave_id);
+}
+
+namespace {
+
+// host registers; the guest registers live in memory, addressed from rbx,
+// and r13 holds the jit_context_t
+enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSI = 6, RDI = 7 };
+
+// condition codes of jcc and setcc
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_L = 0xc, CC_GE = 0xd };
+
+// group 1 arithmetic: the opcode of the register form and the /digit of
+// the immediate form
+struct alu_op_t { uint8_t rr; uint8_t ext; };
+const alu_op_t ADD = {0x01, 0};
+const alu_op_t OR = {0x09, 1};
+const alu_op_t AND = {0x21, 4};
+const alu_op_t SUB = {0x29, 5};
+const alu_op_t XOR = {0x31, 6};
+const alu_op_t CMP = {0x39, 7};
+
+// group 2 shifts
+enum { SHL = 4, SHR = 5, SAR = 7 };
+
+const uint8_t EXECUTED_OFFSET = offsetof(jit_context_t, executed);
+const uint8_t SCRATCH_OFFSET = offsetof(jit_context_t, scratch);
+const uint8_t XPR_OFFSET = offsetof(jit_context_t, xpr);
+
+class emitter_t
+{
+public:
+  std::vector<uint8_t> buf;
+
+  void u8(uint8_t x) { buf.push_back(x); }
+  void u32(uint32_t x) { for (int i = 0; i < 4; i++) u8(x >> (8 * i)); }
+  void u64(uint64_t x) { for (int i = 0; i < 8; i++) u8(x >> (8 * i)); }
+
+  void prologue()
+  {
+    u8(0x53);                         // push rbx
+    u8(0x41); u8(0x55);               // push r13
+    u8(0x41); u8(0x54);               // push r12, keeps rsp 16-byte aligned
+    u8(0x49); u8(0x89); u8(0xfd);     // mov r13, rdi
+    u8(0x48); u8(0x8b); u8(0x5f); u8(XPR_OFFSET); // mov rbx, [rdi + xpr]
+  }
+
+  void epilogue()
+  {
+    u8(0x41); u8(0x5c);               // pop r12
+    u8(0x41); u8(0x5d);               // pop r13
+    u8(0x5b);                         // pop rbx
+    u8(0xc3);                         // ret
+  }
+
+  // return to the interpreter after executed instructions, with the next
+  // pc either given or already in rax
+  void exit(size_t executed, bool pc_in_rax, reg_t pc)
+  {
+    u8(0x49); u8(0xc7); u8(0x45); u8(EXECUTED_OFFSET); u32(executed); // mov qword [r13 + executed], imm32
+    if (!pc_in_rax)
+      mov_imm(RAX, pc);
+    epilogue();
+  }
+
+  // ModRM and displacement for [rbx + 8 * x]
+  void xreg_operand(int r, unsigned x)
+  {
+    if (8 * x < 128) {
+      u8(0x43 | r << 3); u8(8 * x);
+    } else {
+      u8(0x83 | r << 3); u32(8 * x);
+    }
+  }
+
+  void load(int r, unsigned x)
+  {
+    if (x == 0) {
+      u8(0x31); u8(0xc0 | r << 3 | r); // xor r32, r32
+    } else {
+      u8(0x48); u8(0x8b); xreg_operand(r, x); // mov r, [rbx + 8 * x]
+    }
+  }
+
+  void store(unsigned x, int r)
+  {
+    if (x != 0) {
+      u8(0x48); u8(0x89); xreg_operand(r, x); // mov [rbx + 8 * x], r
+    }
+  }
+
+  void lea_xreg(int r, unsigned x) { u8(0x48); u8(0x8d); xreg_operand(r, x); }
+  void lea_scratch(int r) { u8(0x49); u8(0x8d); u8(0x45 | r << 3); u8(SCRATCH_OFFSET); }
+  void mov_rdi_ctx() { u8(0x4c); u8(0x89); u8(0xef); } // mov rdi, r13
+
+  void mov_imm(int r, uint64_t x)
+  {
+    if (int64_t(x) == int32_t(x)) {
+      u8(0x48); u8(0xc7); u8(0xc0 | r); u32(x);
+    } else {
+      u8(0x48); u8(0xb8 | r); u64(x);
+    }
+  }
+
+  void rex_w(bool wide) { if (wide) u8(0x48); }
+  void alu(alu_op_t op, int dst, int src, bool wide) { rex_w(wide); u8(op.rr); u8(0xc0 | src << 3 | dst); }
+  void alu_imm(alu_op_t op, int dst, int32_t imm, bool wide) { rex_w(wide); u8(0x81); u8(0xc0 | op.ext << 3 | dst); u32(imm); }
+  void shift_imm(int ext, int dst, unsigned amount, bool wide) { rex_w(wide); u8(0xc1); u8(0xc0 | ext << 3 | dst); u8(amount); }
+  void shift_cl(int ext, int dst, bool wide) { rex_w(wide); u8(0xd3); u8(0xc0 | ext << 3 | dst); }
+  void imul(int dst, int src, bool wide) { rex_w(wide); u8(0x0f); u8(0xaf); u8(0xc0 | dst << 3 | src); }
+  void movsxd(int r) { u8(0x48); u8(0x63); u8(0xc0 | r << 3 | r); } // movsxd r, r32
+
+  void setcc_rax(int cc)
+  {
+    u8(0x0f); u8(0x90 | cc); u8(0xc0);   // setcc al
+    u8(0x0f); u8(0xb6); u8(0xc0);        // movzx eax, al
+  }
+
+  void call(void* f)
+  {
+    mov_imm(RAX, reinterpret_cast<uint64_t>(f));
+    u8(0xff); u8(0xd0);                  // call rax
+  }
+
+  void test_al() { u8(0x84); u8(0xc0); }
+
+  // short forward jump, patched by bind()
+  size_t jcc8(int cc) { u8(0x70 | cc); u8(0); return buf.size(); }
+  void bind(size_t label)
+  {
+    size_t distance = buf.size() - label;
+    assert(distance < 128);
+    buf[label - 1] = distance;
+  }
+};
+
+// Translates the instructions of a block one at a time. Each translate_*
+// emits the host code for one guest instruction at pc, the index-th of
+// the block.
+class translator_t
+{
+public:
+  emitter_t e;
+  reg_t pc;
+  size_t index;
+  size_t length; // of the current instruction
+
+  void op_imm(alu_op_t op, unsigned rd, unsigned rs1, int64_t imm, bool word)
+  {
+    if (rd == 0)
+      return;
+    e.load(RAX, rs1);
+    e.alu_imm(op, RAX, imm, !word);
+    if (word)
+      e.movsxd(RAX);
+    e.store(rd, RAX);
+  }
+
+  void op_reg(alu_op_t op, unsigned rd, unsigned rs1, unsigned rs2, bool word)
+  {
+    if (rd == 0)
+      return;
+    e.load(RAX, rs1);
+    e.load(RCX, rs2);
+    e.alu(op, RAX, RCX, !word);
+    if (word)
+      e.movsxd(RAX);
+    e.store(rd, RAX);
+  }
+
+  void shift_imm(int ext, unsigned rd, unsigned rs1, unsigned amount, bool word)
+  {
+    if (rd == 0)
+      return;
+    e.load(RAX, rs1);
+    e.shift_imm(ext, RAX, amount, !word);
+    if (word)
+      e.movsxd(RAX);
+    e.store(rd, RAX);
+  }
+
+  // the host masks the shift amount in cl like RISC-V does
+  void shift_reg(int ext, unsigned rd, unsigned rs1, unsigned rs2, bool word)
+  {
+    if (rd == 0)
+      return;
+    e.load(RAX, rs1);
+    e.load(RCX, rs2);
+    e.shift_cl(ext, RAX, !word);
+    if (word)
+      e.movsxd(RAX);
+    e.store(rd, RAX);
+  }
+
+  void set_less(int cc, unsigned rd, unsigned rs1, unsigned rs2)
+  {
+    if (rd == 0)
+      return;
+    e.load(RAX, rs1);
+    e.load(RCX, rs2);
+    e.alu(CMP, RAX, RCX, true);
+    e.setcc_rax(cc);
+    e.store(rd, RAX);
+  }
+
+  void set_less_imm(int cc, unsigned rd, unsigned rs1, int64_t imm)
+  {
+    if (rd == 0)
+      return;
+    e.load(RAX, rs1);
+    e.alu_imm(CMP, RAX, imm, true);
+    e.setcc_rax(cc);
+    e.store(rd, RAX);
+  }
+
+  void mul(unsigned rd, unsigned rs1, unsigned rs2, bool word)
+  {
+    if (rd == 0)
+      return;
+    e.load(RAX, rs1);
+    e.load(RCX, rs2);
+    e.imul(RAX, RCX, !word);
+    if (word)
+      e.movsxd(RAX);
+    e.store(rd, RAX);
+  }
+
+  void constant(unsigned rd, reg_t value)
+  {
+    if (rd == 0)
+      return;
+    e.mov_imm(RAX, value);
+    e.store(rd, RAX);
+  }
+
+  // call a memory helper and leave to the interpreter, before this
+  // instruction, if it fails
+  void call_memory(void* helper)
+  {
+    e.mov_rdi_ctx();
+    e.call(helper);
+    e.test_al();
+    size_t done = e.jcc8(CC_NE);
+    e.exit(index, false, pc);
+    e.bind(done);
+  }
+
+  void load(void* helper, unsigned rd, unsigned rs1, int64_t imm)
+  {
+    e.load(RSI, rs1);
+    e.alu_imm(ADD, RSI, imm, true);
+    if (rd == 0)
+      e.lea_scratch(RDX);
+    else
+      e.lea_xreg(RDX, rd);
+    call_memory(helper);
+  }
+
+  void store(void* helper, unsigned rs2, unsigned rs1, int64_t imm)
+  {
+    e.load(RSI, rs1);
+    e.alu_imm(ADD, RSI, imm, true);
+    e.load(RDX, rs2);
+    call_memory(helper);
+  }
+
+  void branch(int cc, unsigned rs1, unsigned rs2, reg_t target)
+  {
+    e.load(RAX, rs1);
+    e.load(RCX, rs2);
+    e.alu(CMP, RAX, RCX, true);
+    size_t taken = e.jcc8(cc);
+    e.exit(index + 1, false, pc + length);
+    e.bind(taken);
+    e.exit(index + 1, false, target);
+  }
+
+  void jump(unsigned rd, reg_t target)
+  {
+    constant(rd, pc + length);
+    e.exit(index + 1, false, target);
+  }
+
+  void jump_reg(unsigned rd, unsigned rs1, int64_t imm)
+  {
+    e.load(RAX, rs1);
+    e.alu_imm(ADD, RAX, imm, true);
+    e.alu_imm(AND, RAX, -2, true);
+    if (rd != 0) {
+      e.mov_imm(RCX, pc + length);
+      e.store(rd, RCX);
+    }
+    e.exit(index + 1, true, 0);
+  }
+
+  enum result_t { UNSUPPORTED, CONTINUE, END };
+
+  result_t translate(insn_t insn, bool has_m)
+  {
+    insn_bits_t bits = insn.bits();
+    length = insn.length();
+    #define IS(name) ((bits & MASK_##name) == MATCH_##name)
+
+    if (length == 2) {
+      if (IS(C_ADDI4SPN)) {
+        if (insn.rvc_addi4spn_imm() == 0) return UNSUPPORTED;
+        op_imm(ADD, insn.rvc_rs2s(), X_SP, insn.rvc_addi4spn_imm(), false);
+      } else if (IS(C_LW)) {
+        load((void*)&jit_load<int32_t>, insn.rvc_rs2s(), insn.rvc_rs1s(), insn.rvc_lw_imm());
+      } else if (IS(C_LD)) {
+        load((void*)&jit_load<int64_t>, insn.rvc_rs2s(), insn.rvc_rs1s(), insn.rvc_ld_imm());
+      } else if (IS(C_SW)) {
+        store((void*)&jit_store<uint32_t>, insn.rvc_rs2s(), insn.rvc_rs1s(), insn.rvc_lw_imm());
+      } else if (IS(C_SD)) {
+        store((void*)&jit_store<uint64_t>, insn.rvc_rs2s(), insn.rvc_rs1s(), insn.rvc_ld_imm());
+      } else if (IS(C_ADDI)) {
+        op_imm(ADD, insn.rvc_rd(), insn.rvc_rs1(), insn.rvc_imm(), false);
+      } else if (IS(C_ADDIW)) {
+        if (insn.rvc_rd() == 0) return UNSUPPORTED;
+        op_imm(ADD, insn.rvc_rd(), insn.rvc_rs1(), insn.rvc_imm(), true);
+      } else if (IS(C_LI)) {
+        constant(insn.rvc_rd(), insn.rvc_imm());
+      } else if (IS(C_ADDI16SP)) {
+        if (insn.rvc_addi16sp_imm() == 0) return UNSUPPORTED;
+        op_imm(ADD, X_SP, X_SP, insn.rvc_addi16sp_imm(), false);
+      } else if (IS(C_LUI)) {
+        if (insn.rvc_imm() == 0) return UNSUPPORTED;
+        constant(insn.rvc_rd(), insn.rvc_imm() << 12);
+      } else if (IS(C_SRLI)) {
+        shift_imm(SHR, insn.rvc_rs1s(), insn.rvc_rs1s(), insn.rvc_zimm(), false);
+      } else if (IS(C_SRAI)) {
+        shift_imm(SAR, insn.rvc_rs1s(), insn.rvc_rs1s(), insn.rvc_zimm(), false);
+      } else if (IS(C_ANDI)) {
+        op_imm(AND, insn.rvc_rs1s(), insn.rvc_rs1s(), insn.rvc_imm(), false);
+      } else if (IS(C_SUB)) {
+        op_reg(SUB, insn.rvc_rs1s(), insn.rvc_rs1s(), insn.rvc_rs2s(), false);
+      } else if (IS(C_XOR)) {
+        op_reg(XOR, insn.rvc_rs1s(), insn.rvc_rs1s(), insn.rvc_rs2s(), false);
+      } else if (IS(C_OR)) {
+        op_reg(OR, insn.rvc_rs1s(), insn.rvc_rs1s(), insn.rvc_rs2s(), false);
+      } else if (IS(C_AND)) {
+        op_reg(AND, insn.rvc_rs1s(), insn.rvc_rs1s(), insn.rvc_rs2s(), false);
+      } else if (IS(C_SUBW)) {
+        op_reg(SUB, insn.rvc_rs1s(), insn.rvc_rs1s(), insn.rvc_rs2s(), true);
+      } else if (IS(C_ADDW)) {
+        op_reg(ADD, insn.rvc_rs1s(), insn.rvc_rs1s(), insn.rvc_rs2s(), true);
+      } else if (IS(C_J)) {
+        jump(0, pc + insn.rvc_j_imm());
+        return END;
+      } else if (IS(C_BEQZ)) {
+        branch(CC_E, insn.rvc_rs1s(), 0, pc + insn.rvc_b_imm());
+        return END;
+      } else if (IS(C_BNEZ)) {
+        branch(CC_NE, insn.rvc_rs1s(), 0, pc + insn.rvc_b_imm());
+        return END;
+      } else if (IS(C_SLLI)) {
+        shift_imm(SHL, insn.rvc_rd(), insn.rvc_rs1(), insn.rvc_zimm(), false);
+      } else if (IS(C_LWSP)) {
+        if (insn.rvc_rd() == 0) return UNSUPPORTED;
+        load((void*)&jit_load<int32_t>, insn.rvc_rd(), X_SP, insn.rvc_lwsp_imm());
+      } else if (IS(C_LDSP)) {
+        if (insn.rvc_rd() == 0) return UNSUPPORTED;
+        load((void*)&jit_load<int64_t>, insn.rvc_rd(), X_SP, insn.rvc_ldsp_imm());
+      } else if (IS(C_JR)) {
+        if (insn.rvc_rs1() == 0) return UNSUPPORTED;
+        jump_reg(0, insn.rvc_rs1(), 0);
+        return END;
+      } else if (IS(C_MV)) {
+        op_imm(ADD, insn.rvc_rd(), insn.rvc_rs2(), 0, false);
+      } else if (IS(C_EBREAK)) {
+        return UNSUPPORTED;
+      } else if (IS(C_JALR)) {
+        jump_reg(X_RA, insn.rvc_rs1(), 0);
+        return END;
+      } else if (IS(C_ADD)) {
+        op_reg(ADD, insn.rvc_rd(), insn.rvc_rs1(), insn.rvc_rs2(), false);
+      } else if (IS(C_SWSP)) {
+        store((void*)&jit_store<uint32_t>, insn.rvc_rs2(), X_SP, insn.rvc_swsp_imm());
+      } else if (IS(C_SDSP)) {
+        store((void*)&jit_store<uint64_t>, insn.rvc_rs2(), X_SP, insn.rvc_sdsp_imm());
+      } else {
+        return UNSUPPORTED;
+      }
+      return CONTINUE;
+    }
+
+    if (length != 4)
+      return UNSUPPORTED;
+
+    unsigned rd = insn.rd(), rs1 = insn.rs1(), rs2 = insn.rs2();
+    if (IS(LUI)) {
+      constant(rd, insn.u_imm());
+    } else if (IS(AUIPC)) {
+      constant(rd, pc + insn.u_imm());
+    } else if (IS(JAL)) {
+      jump(rd, pc + insn.uj_imm());
+      return END;
+    } else if (IS(JALR)) {
+      jump_reg(rd, rs1, insn.i_imm());
+      return END;
+    } else if (IS(BEQ)) {
+      branch(CC_E, rs1, rs2, pc + insn.sb_imm());
+      return END;
+    } else if (IS(BNE)) {
+      branch(CC_NE, rs1, rs2, pc + insn.sb_imm());
+      return END;
+    } else if (IS(BLT)) {
+      branch(CC_L, rs1, rs2, pc + insn.sb_imm());
+      return END;
+    } else if (IS(BGE)) {
+      branch(CC_GE, rs1, rs2, pc + insn.sb_imm());
+      return END;
+    } else if (IS(BLTU)) {
+      branch(CC_B, rs1, rs2, pc + insn.sb_imm());
+      return END;
+    } else if (IS(BGEU)) {
+      branch(CC_AE, rs1, rs2, pc + insn.sb_imm());
+      return END;
+    } else if (IS(LB)) {
+      load((void*)&jit_load<int8_t>, rd, rs1, insn.i_imm());
+    } else if (IS(LH)) {
+      load((void*)&jit_load<int16_t>, rd, rs1, insn.i_imm());
+    } else if (IS(LW)) {
+      load((void*)&jit_load<int32_t>, rd, rs1, insn.i_imm());
+    } else if (IS(LD)) {
+      load((void*)&jit_load<int64_t>, rd, rs1, insn.i_imm());
+    } else if (IS(LBU)) {
+      load((void*)&jit_load<uint8_t>, rd, rs1, insn.i_imm());
+    } else if (IS(LHU)) {
+      load((void*)&jit_load<uint16_t>, rd, rs1, insn.i_imm());
+    } else if (IS(LWU)) {
+      load((void*)&jit_load<uint32_t>, rd, rs1, insn.i_imm());
+    } else if (IS(SB)) {
+      store((void*)&jit_store<uint8_t>, rs2, rs1, insn.s_imm());
+    } else if (IS(SH)) {
+      store((void*)&jit_store<uint16_t>, rs2, rs1, insn.s_imm());
+    } else if (IS(SW)) {
+      store((void*)&jit_store<uint32_t>, rs2, rs1, insn.s_imm());
+    } else if (IS(SD)) {
+      store((void*)&jit_store<uint64_t>, rs2, rs1, insn.s_imm());
+    } else if (IS(ADDI)) {
+      op_imm(ADD, rd, rs1, insn.i_imm(), false);
+    } else if (IS(SLTI)) {
+      set_less_imm(CC_L, rd, rs1, insn.i_imm());
+    } else if (IS(SLTIU)) {
+      set_less_imm(CC_B, rd, rs1, insn.i_imm());
+    } else if (IS(XORI)) {
+      op_imm(XOR, rd, rs1, insn.i_imm(), false);
+    } else if (IS(ORI)) {
+      op_imm(OR, rd, rs1, insn.i_imm(), false);
+    } else if (IS(ANDI)) {
+      op_imm(AND, rd, rs1, insn.i_imm(), false);
+    } else if (IS(SLLI)) {
+      shift_imm(SHL, rd, rs1, insn.shamt(), false);
+    } else if (IS(SRLI)) {
+      shift_imm(SHR, rd, rs1, insn.shamt(), false);
+    } else if (IS(SRAI)) {
+      shift_imm(SAR, rd, rs1, insn.shamt(), false);
+    } else if (IS(ADD)) {
+      op_reg(ADD, rd, rs1, rs2, false);
+    } else if (IS(SUB)) {
+      op_reg(SUB, rd, rs1, rs2, false);
+    } else if (IS(SLL)) {
+      shift_reg(SHL, rd, rs1, rs2, false);
+    } else if (IS(SLT)) {
+      set_less(CC_L, rd, rs1, rs2);
+    } else if (IS(SLTU)) {
+      set_less(CC_B, rd, rs1, rs2);
+    } else if (IS(XOR)) {
+      op_reg(XOR, rd, rs1, rs2, false);
+    } else if (IS(SRL)) {
+      shift_reg(SHR, rd, rs1, rs2, false);
+    } else if (IS(SRA)) {
+      shift_reg(SAR, rd, rs1, rs2, false);
+    } else if (IS(OR)) {
+      op_reg(OR, rd, rs1, rs2, false);
+    } else if (IS(AND)) {
+      op_reg(AND, rd, rs1, rs2, false);
+    } else if (IS(ADDIW)) {
+      op_imm(ADD, rd, rs1, insn.i_imm(), true);
+    } else if (IS(SLLIW)) {
+      shift_imm(SHL, rd, rs1, insn.shamt(), true);
+    } else if (IS(SRLIW)) {
+      shift_imm(SHR, rd, rs1, insn.shamt(), true);
+    } else if (IS(SRAIW)) {
+      shift_imm(SAR, rd, rs1, insn.shamt(), true);
+    } else if (IS(ADDW)) {
+      op_reg(ADD, rd, rs1, rs2, true);
+    } else if (IS(SUBW)) {
+      op_reg(SUB, rd, rs1, rs2, true);
+    } else if (IS(SLLW)) {
+      shift_reg(SHL, rd, rs1, rs2, true);
+    } else if (IS(SRLW)) {
+      shift_reg(SHR, rd, rs1, rs2, true);
+    } else if (IS(SRAW)) {
+      shift_reg(SAR, rd, rs1, rs2, true);
+    } else if (has_m && IS(MUL)) {
+      mul(rd, rs1, rs2, false);
+    } else if (has_m && IS(MULW)) {
+      mul(rd, rs1, rs2, true);
+    } else {
+      return UNSUPPORTED;
+    }
+    return CONTINUE;
+    #undef IS
+  }
+};
+
+}
+
+jit_t::jit_t(processor_t* proc)
+  : proc(proc), code(NULL), code_used(0)
+{
+  memset(&stats, 0, sizeof(stats));
+#ifdef JIT_HOST_SUPPORTED
+  void* p = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p != MAP_FAILED)
+    code = (uint8_t*)p;
+#endif
+}
+
+jit_t::~jit_t()
+{
+#ifdef JIT_HOST_SUPPORTED
+  if (code)
+    munmap(code, CODE_SIZE);
+#endif
+}
+
+bool jit_t::supported()
+{
+#if defined(JIT_HOST_SUPPORTED) && !defined(RISCV_ENABLE_COMMITLOG)
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool jit_t::translate(reg_t pc, insn_block_t* block)
+{
+  if (!code || proc->get_xlen() != 64 || !proc->supports_extension('C'))
+    return false;
+
+  // Translated blocks are tied to the block cache, so running out of space
+  // retires all blocks and starts over.
+  if (code_used + MAX_INSN_CODE * (block->length + 1) > CODE_SIZE) {
+    code_used = 0;
+    stats.flushes++;
+    proc->get_mmu()->retire_blocks();
+    return false;
+  }
+
+  translator_t t;
+  t.pc = pc;
+  t.e.prologue();
+  size_t translated = 0;
+  bool ended = false;
+  for (t.index = 0; t.index < block->length && !ended; t.index++) {
+    translator_t::result_t result = t.translate(block->insns[t.index].insn, proc->supports_extension('M'));
+    if (result == translator_t::UNSUPPORTED)
+      break;
+    ended = result == translator_t::END;
+    translated++;
+    t.pc += t.length;
+  }
+  if (translated == 0)
+    return false;
+  if (!ended)
+    t.e.exit(translated, false, t.pc);
+
+  memcpy(code + code_used, &t.e.buf[0], t.e.buf.size());
+  block->jit = (jit_func_t)(code + code_used);
+  block->jit_length = translated;
+  block->jit_misa = proc->get_state()->misa;
+  code_used += (t.e.buf.size() + 15) & ~size_t(15);
+
+  stats.translated_blocks++;
+  stats.translated_insns += translated;
+  return true;
+}
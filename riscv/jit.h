@@ -0,0 +1,68 @@
+// See LICENSE for license details.
+// Copyright 2018-2020 Marno van der Maas
+
+#ifndef _RISCV_JIT_H
+#define _RISCV_JIT_H
+
+#include "decode.h"
+#include "mmu.h"
+#include <vector>
+
+class processor_t;
+
+// state passed from the interpreter to translated code
+struct jit_context_t {
+  reg_t* xpr;
+  mmu_t* mmu;
+  enclave_id_t enclave_id;
+  reg_t executed; // instructions completed by the last translated block
+  reg_t scratch;  // destination of loads to x0
+};
+
+struct jit_stats_t {
+  uint64_t translated_blocks;
+  uint64_t translated_insns;
+  uint64_t flushes;
+};
+
+// An optional x86-64 translator for hot basic blocks of RV64 code with the
+// C extension enabled. Translated code covers the common integer,
+// load/store and control-flow instructions; a block is translated up to
+// its first instruction that is not covered. Loads and stores only
+// complete on a plain TLB hit. Whenever that is not the case, translated
+// code returns to the interpreter with the pc of the instruction to run
+// next, so CSRs, traps, enclave tag faults and everything else keep using
+// the insn_func_t implementations, which remain the reference.
+class jit_t
+{
+public:
+  jit_t(processor_t* proc);
+  ~jit_t();
+
+  // whether the host can run translated code
+  static bool supported();
+
+  // Translate the block starting at pc and attach the result to it.
+  // Returns false if not even its first instruction can be translated.
+  bool translate(reg_t pc, insn_block_t* block);
+
+  const jit_stats_t& get_stats() { return stats; }
+
+  // state shared with translated code
+  jit_context_t context;
+
+  // number of executions after which a block is translated
+  static const uint32_t HOT_THRESHOLD = 64;
+
+private:
+  processor_t* proc;
+  uint8_t* code;
+  size_t code_used;
+  jit_stats_t stats;
+
+  static const size_t CODE_SIZE = 16 << 20;
+  // longest host code a single guest instruction is translated into
+  static const size_t MAX_INSN_CODE = 128;
+};
+
+#endif
@@ -0,0 +1,73 @@
+// See LICENSE for license details.
+// Copyright 2018-2020 Marno van der Maas
+
+#include "devices.h"
+#include "debug.h"
+#include <cstddef>
+
+mailbox_t::mailbox_t(size_t nharts)
+  : messages((MAILBOX_SIZE + sizeof(Message_t) - 1) / sizeof(Message_t)),
+    loads(0), stores(0), invalidations(0)
+{
+  if (nharts * sizeof(Message_t) > MAILBOX_SIZE) {
+    fprintf(stderr, "mailbox.cc: ERROR mailbox size bigger than the memory.\n");
+    exit(-2);
+  }
+  memset(&messages[0], 0xff, messages.size() * sizeof(Message_t));
+}
+
+bool mailbox_t::load(reg_t addr, size_t len, uint8_t* bytes)
+{
+  if (addr + len > MAILBOX_SIZE)
+    return false;
+  memcpy(bytes, (uint8_t*)&messages[0] + addr, len);
+  return true;
+}
+
+bool mailbox_t::store(reg_t addr, size_t len, const uint8_t* bytes)
+{
+  if (addr + len > MAILBOX_SIZE)
+    return false;
+  memcpy((uint8_t*)&messages[0] + addr, bytes, len);
+  return true;
+}
+
+bool mailbox_t::hart_load(reg_t addr, size_t len, uint8_t* bytes, uint32_t hart_id, enclave_id_t enclave_id)
+{
+  if (!load(addr, len, bytes))
+    return false;
+  loads++;
+
+  // We assume that type is the first element of the message. We invalidate
+  // the message if the enclave it is addressed to is reading it.
+  if (addr % sizeof(Message_t) == 0) {
+    Message_t* message = &messages[addr / sizeof(Message_t)];
+    if (message->type != MSG_INVALID && message->destination == enclave_id) {
+#ifdef PRAESIDIO_DEBUG
+      fprintf(stderr, "mailbox.cc: Invalidating message for enclave 0x%x at offset 0x%lx with type 0x%x, source 0x%x, dest 0x%x\n", enclave_id, addr, message->type, message->source, message->destination);
+#endif
+      message->type = MSG_INVALID;
+      invalidations++;
+    }
+  }
+  return true;
+}
+
+bool mailbox_t::hart_store(reg_t addr, size_t len, const uint8_t* bytes, uint32_t hart_id, enclave_id_t enclave_id)
+{
+  if (addr + len > sizeof(Message_t)) {
+    fprintf(stderr, "mailbox.cc: writing out of mailbox bounds.\n");
+    return false;
+  }
+  reg_t slot = hart_id * sizeof(Message_t);
+  if (!store(slot + addr, len, bytes))
+    return false;
+  stores++;
+
+  // Make sure the source is always the correct enclave identifier.
+  messages[hart_id].source = enclave_id;
+#ifdef PRAESIDIO_DEBUG
+  fprintf(stderr, "mailbox.cc: enclave 0x%x writing to mailbox of hart %u at offset 0x%lx\n", enclave_id, hart_id, addr);
+#endif
+  return true;
+}
@@ -5,41 +5,391 @@
 #include "simif.h"
 #include "processor.h"
 #include "debug.h"
+#include <cassert>
 
-mmu_t::mmu_t(simif_t* sim, processor_t* proc, page_tag_t *tag_directory, size_t num_of_pages)
- : sim(sim), proc(proc), tag_directory(tag_directory), num_of_pages(num_of_pages),
+mmu_t::mmu_t(simif_t* sim, processor_t* proc, tag_directory_t *tag_directory)
+ : sim(sim), proc(proc), tag_directory(tag_directory), num_of_pages(tag_directory->size()),
+  last_mem_region({0, 0, NULL, NULL}),
   check_triggers_fetch(false),
   check_triggers_load(false),
   check_triggers_store(false),
   matched_trigger(NULL)
 {
-  flush_tlb();
+  fetch_traced = false;
+  shared_accesses = 0;
+  walk_global = false;
+  walk_vpn_mask = 0;
+  fetch_vpn_mask = 0;
+  concurrent = false;
+  concurrent_enclave_id = ENCLAVE_INVALID_ID;
+  decode_cache = NULL;
+  decode_class = 0;
+  last_code_page = -1;
+  icache_generation = 0;
+  for (size_t i = 0; i < BLOCK_CACHE_ENTRIES; i++)
+    blocks[i].tag = -1;
+  set_tlb_geometry(DEFAULT_TLB_ENTRIES, DEFAULT_TLB_WAYS);
+  flush_walk_cache();
   yield_load_reservation();
+  tag_directory->subscribe(this);
 }
 
 mmu_t::~mmu_t()
 {
+  tag_directory->unsubscribe(this);
+}
+
+void mmu_t::set_decode_cache(decode_cache_t* cache, reg_t decode_class)
+{
+  this->decode_cache = cache;
+  this->decode_class = decode_class;
+  flush_icache();
 }
 
 void mmu_t::flush_icache()
 {
   for (size_t i = 0; i < ICACHE_ENTRIES; i++)
     icache[i].tag = -1;
+  icache_generation++;
+
+  for (reg_t ppn : icache_pages)
+    release_code_page(ppn);
+  icache_pages.clear();
+  dirty_code_pages.clear();
+  last_code_page = -1;
+}
+
+void mmu_t::fence_i()
+{
+  if (likely(dirty_code_pages.empty()))
+    return;
+
+  // Drop the instructions on written pages and those straddling two pages,
+  // whose second page is not recorded, then stop tracking pages that no
+  // longer hold any instructions.
+  std::set<reg_t> cached_pages;
+  icache_generation++;
+  for (size_t i = 0; i < ICACHE_ENTRIES; i++) {
+    if (icache[i].tag == reg_t(-1))
+      continue;
+    reg_t paddr = icache[i].paddr;
+    if ((paddr & (PGSIZE - 1)) + icache[i].data.insn.length() > PGSIZE ||
+        dirty_code_pages.count(paddr >> PGSHIFT))
+      icache[i].tag = -1;
+    else
+      cached_pages.insert(paddr >> PGSHIFT);
+  }
+
+  for (reg_t ppn : icache_pages)
+    if (!cached_pages.count(ppn))
+      release_code_page(ppn);
+  icache_pages.swap(cached_pages);
+  dirty_code_pages.clear();
+  last_code_page = -1;
+}
+
+void mmu_t::release_code_page(reg_t ppn)
+{
+  if (concurrent)
+    released_code_pages.push_back(ppn);
+  else
+    sim->code_page_released(ppn);
+}
+
+void mmu_t::begin_concurrent(enclave_id_t enclave_id)
+{
+  concurrent = true;
+  concurrent_enclave_id = enclave_id;
+
+  // Translations of pages the hart may no longer access have to take the
+  // slow path, which yields.
+  for (size_t i = 0; i < tlb_data.size(); i++) {
+    reg_t vpn;
+    if (!tlb_entry_vpn(i, &vpn))
+      continue;
+    reg_t vaddr = vpn << PGSHIFT;
+    if (!concurrent_private(tlb_data[i].target_offset + vaddr))
+      tlb_load_tag[i] = tlb_store_tag[i] = tlb_insn_tag[i] = -1;
+  }
+  for (reg_t ppn : walk_cache_pages) {
+    if (!concurrent_private(ppn << PGSHIFT)) {
+      flush_walk_cache();
+      break;
+    }
+  }
+}
+
+void mmu_t::end_concurrent()
+{
+  concurrent = false;
+  for (reg_t ppn : released_code_pages)
+    sim->code_page_released(ppn);
+  released_code_pages.clear();
+}
+
+void mmu_t::code_page_written(reg_t ppn)
+{
+  if (icache_pages.count(ppn))
+    dirty_code_pages.insert(ppn);
+}
+
+void mmu_t::drop_store_translations(reg_t ppn)
+{
+  for (size_t i = 0; i < tlb_data.size(); i++) {
+    reg_t tag = tlb_store_tag[i] & ~TLB_FLAGS;
+    if (tlb_store_tag[i] != reg_t(-1) &&
+        (tlb_data[i].target_offset + (tag << PGSHIFT)) >> PGSHIFT == ppn)
+      tlb_store_tag[i] = -1;
+  }
 }
 
 void mmu_t::flush_tlb()
 {
-  memset(tlb_insn_tag, -1, sizeof(tlb_insn_tag));
-  memset(tlb_load_tag, -1, sizeof(tlb_load_tag));
-  memset(tlb_store_tag, -1, sizeof(tlb_store_tag));
+  std::fill(tlb_insn_tag.begin(), tlb_insn_tag.end(), reg_t(-1));
+  std::fill(tlb_load_tag.begin(), tlb_load_tag.end(), reg_t(-1));
+  std::fill(tlb_store_tag.begin(), tlb_store_tag.end(), reg_t(-1));
+  fetch_vpn_mask = 0;
 
   flush_icache();
 }
 
-reg_t mmu_t::translate(reg_t addr, access_type type)
+void mmu_t::flush_walk_cache()
+{
+  memset(walk_cache, 0, sizeof(walk_cache));
+  walk_cache_pages.clear();
+}
+
+void mmu_t::refill_walk_cache(int level, reg_t va_prefix, reg_t satp, reg_t base, bool global, reg_t pte_paddr)
+{
+  walk_cache_entry_t* entry = &walk_cache[level][va_prefix % WALK_CACHE_ENTRIES];
+  entry->satp = satp;
+  entry->va_prefix = va_prefix;
+  entry->base = base;
+  entry->global = global;
+
+  // Stores to the page holding this PTE must reach store_slow_path, so
+  // drop any store translation that already maps it.
+  reg_t ppn = pte_paddr >> PGSHIFT;
+  if (walk_cache_pages.insert(ppn).second)
+    drop_store_translations(ppn);
+}
+
+void mmu_t::sfence_vma(reg_t vaddr, bool all_addresses, reg_t asid, bool all_asids)
+{
+  reg_t vpn = vaddr >> PGSHIFT;
+
+  // Superpages are cached as 4 KiB entries, each of which is ordered by a
+  // fence for any address the leaf PTE spans.
+  for (size_t i = 0; i < tlb_data.size(); i++) {
+    reg_t entry_vpn;
+    if (!tlb_entry_vpn(i, &entry_vpn))
+      continue;
+    if (!all_addresses && ((entry_vpn ^ vpn) & ~tlb_data[i].vpn_mask) != 0)
+      continue;
+    if (!all_asids && (tlb_data[i].global || tlb_data[i].asid != asid))
+      continue;
+    tlb_load_tag[i] = -1;
+    tlb_store_tag[i] = -1;
+    tlb_insn_tag[i] = -1;
+  }
+
+  if (all_addresses) {
+    // Non-leaf PTEs are only ordered by a fence for all addresses.
+    flush_walk_cache();
+    flush_unmapped_icache();
+  } else {
+    // Instructions may straddle into the fenced page from the one before,
+    // and may have been fetched through any superpage spanning it.
+    icache_generation++;
+    for (size_t i = 0; i < ICACHE_ENTRIES; i++) {
+      reg_t addr = icache[i].tag;
+      if (addr != reg_t(-1) &&
+          ((((addr >> PGSHIFT) ^ vpn) & ~fetch_vpn_mask) == 0 ||
+           (((addr + icache[i].data.insn.length() - 1) >> PGSHIFT ^ vpn) & ~fetch_vpn_mask) == 0))
+        icache[i].tag = -1;
+    }
+  }
+}
+
+void mmu_t::flush_unmapped_icache()
+{
+  icache_generation++;
+  for (size_t i = 0; i < ICACHE_ENTRIES; i++) {
+    reg_t addr = icache[i].tag;
+    if (addr == reg_t(-1))
+      continue;
+    reg_t last = addr + icache[i].data.insn.length() - 1;
+    bool mapped = true;
+    for (reg_t page = addr >> PGSHIFT; mapped && page <= last >> PGSHIFT; page++) {
+      size_t idx = tlb_index(page);
+      mapped = false;
+      for (size_t way = 0; way < tlb_ways; way++) {
+        if ((tlb_insn_tag[idx + way] & ~TLB_FLAGS) == page &&
+            (page != addr >> PGSHIFT ||
+             (tlb_data[idx + way].target_offset + addr) >> PGSHIFT == icache[i].paddr >> PGSHIFT)) {
+          mapped = true;
+          break;
+        }
+      }
+    }
+    if (!mapped)
+      icache[i].tag = -1;
+  }
+}
+
+void mmu_t::set_tlb_geometry(size_t entries, size_t ways)
+{
+  assert(ways > 0 && (ways & (ways - 1)) == 0);
+  assert(entries >= ways && (entries & (entries - 1)) == 0);
+
+  tlb_ways = ways;
+  tlb_ways_shift = 0;
+  while ((size_t(1) << tlb_ways_shift) < ways)
+    tlb_ways_shift++;
+  tlb_set_mask = entries / ways - 1;
+
+  tlb_data.assign(entries, tlb_entry_t());
+  tlb_insn_tag.resize(entries);
+  tlb_load_tag.resize(entries);
+  tlb_store_tag.resize(entries);
+  memset(&tlb_stats, 0, sizeof(tlb_stats));
+
+  flush_tlb();
+}
+
+void mmu_t::tlb_move_to_front(size_t idx, size_t way)
+{
+  tlb_entry_t data = tlb_data[idx + way];
+  reg_t insn_tag = tlb_insn_tag[idx + way];
+  reg_t load_tag = tlb_load_tag[idx + way];
+  reg_t store_tag = tlb_store_tag[idx + way];
+
+  for (size_t i = idx + way; i > idx; i--) {
+    tlb_data[i] = tlb_data[i - 1];
+    tlb_insn_tag[i] = tlb_insn_tag[i - 1];
+    tlb_load_tag[i] = tlb_load_tag[i - 1];
+    tlb_store_tag[i] = tlb_store_tag[i - 1];
+  }
+
+  tlb_data[idx] = data;
+  tlb_insn_tag[idx] = insn_tag;
+  tlb_load_tag[idx] = load_tag;
+  tlb_store_tag[idx] = store_tag;
+}
+
+bool mmu_t::tlb_promote(reg_t vpn, size_t idx, const reg_t* tags)
+{
+  for (size_t way = 1; way < tlb_ways; way++) {
+    if ((tags[idx + way] & ~TLB_FLAGS) == vpn) {
+      tlb_move_to_front(idx, way);
+      return true;
+    }
+  }
+  return false;
+}
+
+void mmu_t::page_tag_changed(size_t page_num)
+{
+  reg_t ppn = (DRAM_BASE >> PGSHIFT) + page_num;
+
+  for (size_t i = 0; i < tlb_data.size(); i++) {
+    reg_t vpn;
+    if (!tlb_entry_vpn(i, &vpn))
+      continue;
+    reg_t vaddr = vpn << PGSHIFT;
+    if ((tlb_data[i].target_offset + vaddr) >> PGSHIFT == ppn) {
+      tlb_load_tag[i] = -1;
+      tlb_store_tag[i] = -1;
+      tlb_insn_tag[i] = -1;
+    }
+  }
+
+  icache_generation++;
+  for (size_t i = 0; i < ICACHE_ENTRIES; i++)
+    if (icache[i].paddr >> PGSHIFT == ppn)
+      icache[i].tag = -1;
+}
+
+// whether insn may change control flow or processor state, e.g. by
+// returning a serializing npc; conservative for compressed instructions
+// whose funct3 is shared with ordinary ones, and for custom opcodes
+static bool insn_ends_block(insn_t insn)
+{
+  insn_bits_t bits = insn.bits();
+  switch (bits & 3) {
+    case 0: // C0: loads and stores
+      return false;
+    case 1: // C1: c.jal, c.j, c.beqz, c.bnez
+      switch ((bits >> 13) & 7) {
+        case 1: case 5: case 6: case 7: return true;
+        default: return false;
+      }
+    case 2: // C2: c.jr, c.jalr, c.ebreak
+      return ((bits >> 13) & 7) == 4;
+  }
+  if (insn.length() != 4)
+    return true;
+  switch (bits & 0x7f) {
+    case 0x0f: // MISC-MEM: fence.i
+    case 0x63: // BRANCH
+    case 0x67: // JALR
+    case 0x6f: // JAL
+    case 0x73: // SYSTEM
+    case 0x0b: case 0x2b: case 0x5b: case 0x7b: // custom
+      return true;
+    default:
+      return false;
+  }
+}
+
+insn_block_t* mmu_t::refill_block(reg_t addr, insn_block_t* block, enclave_id_t enclave_id)
+{
+  // Faults on the first instruction are taken as usual.
+  icache_entry_t* entry = access_icache(addr, enclave_id);
+  if (!entry)
+    return NULL;
+  block->tag = -1;
+  block->length = 0;
+  block->insns[block->length++] = entry->data;
+
+  // Extend the block while the instructions stay on the same page. A later
+  // instruction that cannot be fetched ends the block, as its fault must
+  // only be taken if the instructions before it complete. Likewise, a
+  // fetch trigger on a later instruction must not fire early, so blocks are
+  // not extended while fetch triggers are set.
+  reg_t pc = addr;
+  while (!check_triggers_fetch && block->length < MAX_BLOCK_INSNS &&
+         !insn_ends_block(entry->data.insn)) {
+    pc += entry->data.insn.length();
+    if (pc >> PGSHIFT != addr >> PGSHIFT)
+      break;
+    try {
+      entry = access_icache(pc, enclave_id);
+    } catch (trap_t& t) {
+      break;
+    } catch (concurrent_yield_t& t) {
+      break;
+    }
+    if (!entry)
+      break;
+    block->insns[block->length++] = entry->data;
+  }
+
+  block->tag = addr;
+  block->generation = icache_generation;
+  block->executions = 0;
+  block->jit = NULL;
+  return block;
+}
+
+bool mmu_t::translate(reg_t addr, access_type type, reg_t* paddr)
 {
-  if (!proc)
-    return addr;
+  walk_global = false;
+  walk_vpn_mask = 0;
+  if (!proc) {
+    *paddr = addr;
+    return true;
+  }
 
   reg_t mode = proc->state.prv;
   if (type != FETCH) {
@@ -47,16 +397,36 @@ reg_t mmu_t::translate(reg_t addr, access_type type)
       mode = get_field(proc->state.mstatus, MSTATUS_MPP);
   }
 
-  return walk(addr, type, mode) | (addr & (PGSIZE-1));
+  if (!walk(addr, type, mode, paddr))
+    return false;
+  *paddr |= addr & (PGSIZE-1);
+  return true;
+}
+
+void mmu_t::throw_fault()
+{
+  switch (fault.cause) {
+    case CAUSE_FETCH_ACCESS: throw trap_instruction_access_fault(fault.tval);
+    case CAUSE_LOAD_ACCESS: throw trap_load_access_fault(fault.tval);
+    case CAUSE_STORE_ACCESS: throw trap_store_access_fault(fault.tval);
+    case CAUSE_FETCH_PAGE_FAULT: throw trap_instruction_page_fault(fault.tval);
+    case CAUSE_LOAD_PAGE_FAULT: throw trap_load_page_fault(fault.tval);
+    case CAUSE_STORE_PAGE_FAULT: throw trap_store_page_fault(fault.tval);
+    default: abort();
+  }
 }
 
 tlb_entry_t mmu_t::fetch_slow_path(reg_t vaddr, enclave_id_t enclave_id)
 {
-  reg_t paddr = translate(vaddr, FETCH);
-  auto host_addr = sim->addr_to_mem(paddr);
+  tlb_stats.misses++;
+  reg_t paddr;
+  if (!translate(vaddr, FETCH, &paddr))
+    throw_fault();
+  check_concurrent_access(paddr);
+  auto host_addr = addr_to_mem(paddr);
   if (host_addr) {
     if(check_identifier(paddr, enclave_id, true)) {
-      return refill_tlb(vaddr, paddr, host_addr, FETCH);
+      return refill_tlb(vaddr, paddr, host_addr, FETCH, enclave_id);
     } else {
 #ifdef PRAESIDIO_DEBUG
       fprintf(stderr, "mmu.cc: Warning! Denying fetch to enclave 0x%08x, virtual address 0x%lx, physical address 0x%lx, number of pages %lu, page size 0x%lx\n", enclave_id, vaddr, (uint64_t) host_addr, num_of_pages, PGSIZE);
@@ -105,172 +475,219 @@ bool mmu_t::check_identifier(reg_t paddr, enclave_id_t id, bool load, enclave_id
   if(paddr >= DRAM_BASE && paddr < DRAM_BASE + PGSIZE*num_of_pages) {
     reg_t dram_offset = paddr - DRAM_BASE;
     reg_t page_num = dram_offset / PGSIZE;
-    if(load && id == tag_directory[page_num].reader) {
+    if(load && id == tag_directory->get(page_num).reader) {
       if(writer_id == NULL) {
         printf("Checking identifier and wanting to set writer_id return value to true, but reader pointer is NULL.\n");
         exit(-5);
       }
-      *writer_id = tag_directory[page_num].owner;
+      *writer_id = tag_directory->get(page_num).owner;
       return true;
     }
-    return id == tag_directory[page_num].owner;
+    return id == tag_directory->get(page_num).owner;
   }
   return true;
 }
 
-void mmu_t::load_slow_path(reg_t addr, reg_t len, uint8_t* bytes, enclave_id_t enclave_id)
+void mmu_t::trace_load(reg_t paddr, reg_t len, enclave_id_t writer_id, enclave_id_t enclave_id)
+{
+  trace_result resultOfTrace = tracer.trace(paddr, len, LOAD);
+  if(resultOfTrace == LLC_MISS) {
+#ifdef COVERT_CHANNEL_POC
+      proc->set_csr(CSR_LLCMISSCOUNT, 1);
+#endif //COVERT_CHANNEL_POC
+  }
+  if(resultOfTrace == NO_LLC_INTERACTION && writer_id != ENCLAVE_INVALID_ID) {
+      proc->sim->process_enclave_read_access(paddr, writer_id, enclave_id);
+  }
+}
+
+bool mmu_t::load_slow_path(reg_t addr, reg_t len, uint8_t* bytes, enclave_id_t enclave_id)
 {
+  tlb_stats.misses++;
   enclave_id_t writer_id = ENCLAVE_INVALID_ID;
-  reg_t paddr = translate(addr, LOAD);
-  if (auto host_addr = sim->addr_to_mem(paddr)) {
+  reg_t paddr;
+  if (!translate(addr, LOAD, &paddr))
+    return false;
+  check_concurrent_access(paddr);
+  if (auto host_addr = addr_to_mem(paddr)) {
     if(check_identifier(paddr, enclave_id, true, &writer_id)) {
       memcpy(bytes, host_addr, len);
-      if((paddr >= MAILBOX_BASE) && (paddr < MAILBOX_BASE + MAILBOX_SIZE)) {
-        if(((paddr - MAILBOX_BASE) % (sizeof(struct Message_t))) == 0) { //We assume that type is the first element of the mailbox. We will invalidate the message if the correct enclave is reading it.
-          struct Message_t *mailbox = (struct Message_t *) sim->addr_to_mem(paddr);
-          if(mailbox->type != MSG_INVALID && mailbox->destination == enclave_id) {
-#ifdef PRAESIDIO_DEBUG
-            fprintf(stderr, "mmu.cc: Invalidating message for enclave 0x%x and address %016lx with type 0x%x, source 0x%x, dest 0x%x\n", enclave_id, paddr, mailbox->type, mailbox->source, mailbox->destination);
-#endif
-            mailbox->type = MSG_INVALID;
-          }
-// #ifdef PRAESIDIO_DEBUG
-//           else {
-//             fprintf(stderr, "mmu.cc: Message read by 0x%x at address %016lx has type 0x%x and destination 0x%x\n", enclave_id, paddr, mailbox->type, mailbox->destination);
-//           }
-// #endif
-        }
-// #ifdef PRAESIDIO_DEBUG
-//         else {
-//           fprintf(stderr, "mmu.cc: Reading mailbox address %016lx with enclave 0x%x\n", paddr, enclave_id);
-//         }
-// #endif
-      }
-      if (tracer.interested_in_range(paddr, paddr + PGSIZE, LOAD)) {
-        trace_result resultOfTrace = tracer.trace(paddr, len, LOAD);
-        if(resultOfTrace == LLC_MISS) {
-#ifdef COVERT_CHANNEL_POC
-            proc->set_csr(CSR_LLCMISSCOUNT, 1);
-#endif //COVERT_CHANNEL_POC
-        }
-        if(resultOfTrace == NO_LLC_INTERACTION && writer_id != ENCLAVE_INVALID_ID) {
-            proc->sim->process_enclave_read_access(paddr, writer_id, enclave_id);
-        }
-      } else {
-        refill_tlb(addr, paddr, host_addr, LOAD);
-      }
+      if (writer_id != ENCLAVE_INVALID_ID)
+        shared_accesses++;
+      if (tracer.interested_in_range(paddr, paddr + PGSIZE, LOAD))
+        trace_load(paddr, len, writer_id, enclave_id);
+      refill_tlb(addr, paddr, host_addr, LOAD, enclave_id);
     } else {
 #ifdef PRAESIDIO_DEBUG
       fprintf(stderr, "mmu.cc: Warning! Denying load access to enclave 0x%08x, virtual address 0x%016lx, physical address 0x%016lx, number of pages %lu, page size 0x%lx\n", enclave_id, addr, paddr, num_of_pages, PGSIZE);
 #endif
-      throw trap_load_access_fault(addr);
+      return record_fault(CAUSE_LOAD_ACCESS, addr);
     }
-  } else if (!sim->mmio_load(paddr, len, bytes)) {
+  } else if (!(proc ? sim->mmio_hart_load(paddr, len, bytes, proc->id, enclave_id)
+                    : sim->mmio_load(paddr, len, bytes))) {
 #ifdef PRAESIDIO_DEBUG
-    fprintf(stderr, "mmu.cc: throwing load access fault for address 0x%016lx\n", addr);
+    fprintf(stderr, "mmu.cc: load access fault for address 0x%016lx\n", addr);
 #endif
-    throw trap_load_access_fault(addr);
+    return record_fault(CAUSE_LOAD_ACCESS, addr);
   }
 
-  if (!matched_trigger) {
+  if (check_triggers_load && !matched_trigger) {
     reg_t data = reg_from_bytes(len, bytes);
     matched_trigger = trigger_exception(OPERATION_LOAD, addr, data);
     if (matched_trigger)
       throw *matched_trigger;
   }
+  return true;
 }
 
-void mmu_t::store_slow_path(reg_t addr, reg_t len, const uint8_t* bytes, enclave_id_t enclave_id)
+bool mmu_t::store_slow_path(reg_t addr, reg_t len, const uint8_t* bytes, enclave_id_t enclave_id)
 {
-  reg_t paddr = translate(addr, STORE);
-  if (!matched_trigger) {
+  tlb_stats.misses++;
+  reg_t paddr;
+  if (!translate(addr, STORE, &paddr))
+    return false;
+  check_concurrent_access(paddr);
+  if (unlikely(concurrent) && sim->is_code_page(paddr >> PGSHIFT))
+    throw concurrent_yield_t();
+  if (check_triggers_store && !matched_trigger) {
     reg_t data = reg_from_bytes(len, bytes);
     matched_trigger = trigger_exception(OPERATION_STORE, addr, data);
     if (matched_trigger)
       throw *matched_trigger;
   }
-  if((paddr >= MAILBOX_BASE) && (paddr < MAILBOX_BASE + MAILBOX_SIZE)) {
-    if((paddr - (reg_t) MAILBOX_BASE) > sizeof(struct Message_t)) {
-      fprintf(stderr, "mmu.cc: writing out of mailbox bounds.\n");
-      throw trap_store_access_fault(addr);
-    }
-    paddr += (sizeof(struct Message_t)) * (proc->id);
-#ifdef PRAESIDIO_DEBUG
-    fprintf(stderr, "mmu.cc: enclave 0x%x writing to mailbox address 0x%016lx\nmmu.cc: Content of mailboxes:", enclave_id, paddr);
-    for(unsigned int i = 0; i < 4*sizeof(struct Message_t)/4; i++) {
-      if(i%8 == 0) {
-        fprintf(stderr, "\nmmu.cc: ");
-      }
-      fprintf(stderr, "%08x ", ((int *) sim->addr_to_mem(MAILBOX_BASE))[i]);
-    }
-    fprintf(stderr, "\n");
-#endif
-  }
-
-  if (auto host_addr = sim->addr_to_mem(paddr)) {
+  if (auto host_addr = addr_to_mem(paddr)) {
     if(check_identifier(paddr, enclave_id, false)) {
       memcpy(host_addr, bytes, len);
-      if((paddr >= MAILBOX_BASE) && (paddr < MAILBOX_BASE + MAILBOX_SIZE)) {
-        struct Message_t *mailbox = (struct Message_t *) sim->addr_to_mem(MAILBOX_BASE + (sizeof(struct Message_t)) * (proc->id));
-        mailbox->source = enclave_id; //Make sure the source is always the correct enclave identifier.
-#ifdef PRAESIDIO_DEBUG
-        fprintf(stderr, "mmu.cc: setting the source to 0x%x of mailbox 0x%016lx\n", enclave_id, paddr);
-#endif
-      }
+      if (unlikely(!walk_cache_pages.empty()) &&
+          walk_cache_pages.count(paddr >> PGSHIFT))
+        flush_walk_cache();
+      if (unlikely(sim->is_code_page(paddr >> PGSHIFT)))
+        sim->code_page_written(paddr >> PGSHIFT);
       if (tracer.interested_in_range(paddr, paddr + PGSIZE, STORE))
         tracer.trace(paddr, len, STORE); //TODO should tracer know about an unauthorized store?
-      else
-        refill_tlb(addr, paddr, host_addr, STORE);
+      refill_tlb(addr, paddr, host_addr, STORE, enclave_id);
     } else {
 #ifdef PRAESIDIO_DEBUG
       fprintf(stderr, "mmu.cc: Warning! Denying store access to enclave 0x%08x, virtual address 0x%016lx, physical address 0x%016lx, number of pages %lu, page size 0x%0lx\n", enclave_id, addr, paddr, num_of_pages, PGSIZE);
 #endif
-      throw trap_store_access_fault(addr);
+      return record_fault(CAUSE_STORE_ACCESS, addr);
     }
-  } else if (!sim->mmio_store(paddr, len, bytes)) {
+  } else if (!(proc ? sim->mmio_hart_store(paddr, len, bytes, proc->id, enclave_id)
+                    : sim->mmio_store(paddr, len, bytes))) {
+    return record_fault(CAUSE_STORE_ACCESS, addr);
+  }
+  return true;
+}
+
+char* mmu_t::amo_slow_path(reg_t addr, reg_t len, enclave_id_t enclave_id)
+{
+  if (check_triggers_load || check_triggers_store)
+    return NULL;
+
+  tlb_stats.misses++;
+  reg_t paddr;
+  if (!translate(addr, STORE, &paddr))
+    throw_fault();
+  check_concurrent_access(paddr);
+  if (unlikely(concurrent) && sim->is_code_page(paddr >> PGSHIFT))
+    throw concurrent_yield_t();
+  auto host_addr = addr_to_mem(paddr);
+  if (!host_addr)
+    return NULL;
+
+  // Stores are only allowed to the owner, which may also load.
+  if(!check_identifier(paddr, enclave_id, false)) {
+#ifdef PRAESIDIO_DEBUG
+    fprintf(stderr, "mmu.cc: Warning! Denying AMO access to enclave 0x%08x, virtual address 0x%016lx, physical address 0x%016lx\n", enclave_id, addr, paddr);
+#endif
     throw trap_store_access_fault(addr);
   }
+  if (unlikely(!walk_cache_pages.empty()) &&
+      walk_cache_pages.count(paddr >> PGSHIFT))
+    flush_walk_cache();
+  if (unlikely(sim->is_code_page(paddr >> PGSHIFT)))
+    sim->code_page_written(paddr >> PGSHIFT);
+  if (tracer.interested_in_range(paddr, paddr + PGSIZE, STORE))
+    tracer.trace(paddr, len, STORE);
+  refill_tlb(addr, paddr, host_addr, STORE, enclave_id);
+  return host_addr;
 }
 
-tlb_entry_t mmu_t::refill_tlb(reg_t vaddr, reg_t paddr, char* host_addr, access_type type)
+tlb_entry_t mmu_t::refill_tlb(reg_t vaddr, reg_t paddr, char* host_addr, access_type type, enclave_id_t enclave_id)
 {
-  reg_t idx = (vaddr >> PGSHIFT) % TLB_ENTRIES;
   reg_t expected_tag = vaddr >> PGSHIFT;
+  size_t idx = tlb_index(expected_tag);
 
-  if ((tlb_load_tag[idx] & ~TLB_CHECK_TRIGGERS) != expected_tag)
+  enclave_id_t owner = enclave_id;
+  enclave_id_t reader = ENCLAVE_INVALID_ID;
+  if(paddr >= DRAM_BASE && paddr < DRAM_BASE + PGSIZE*num_of_pages) {
+    reg_t dram_offset = paddr - DRAM_BASE;
+    reg_t page_num = dram_offset / PGSIZE;
+    owner = tag_directory->get(page_num).owner;
+    reader = tag_directory->get(page_num).reader;
+  }
+  reg_t asid = proc ? get_field(proc->state.satp, proc->max_xlen == 32 ? SATP32_ASID : SATP64_ASID) : 0;
+  tlb_entry_t entry = {host_addr - vaddr, paddr - vaddr, owner, reader, asid, walk_global, walk_vpn_mask};
+  if (type == FETCH)
+    fetch_vpn_mask |= walk_vpn_mask;
+
+  // Stores to page-table pages must invalidate the page-walk cache, and
+  // stores to pages holding decoded instructions must be seen by fence.i.
+  if (type == STORE && (walk_cache_pages.count(paddr >> PGSHIFT) ||
+                        sim->is_code_page(paddr >> PGSHIFT)))
+    return entry;
+
+  // Traced data accesses keep hitting in the TLB and are reported by the
+  // fast path, except for pages shared with a reader: reads of those may
+  // need a cross-enclave writeback, which only the slow path performs.
+  bool traced = type != FETCH && tracer.interested_in_range(paddr, paddr + PGSIZE, type);
+  if (traced && reader != ENCLAVE_INVALID_ID)
+    return entry;
+
+  // Reuse the way that already caches this page for another access type,
+  // otherwise evict the least recently used way.
+  size_t way = tlb_ways - 1;
+  for (size_t i = 0; i < tlb_ways; i++) {
+    if ((tlb_load_tag[idx + i] & ~TLB_FLAGS) == expected_tag ||
+        (tlb_store_tag[idx + i] & ~TLB_FLAGS) == expected_tag ||
+        (tlb_insn_tag[idx + i] & ~TLB_FLAGS) == expected_tag) {
+      way = i;
+      break;
+    }
+  }
+  tlb_move_to_front(idx, way);
+  tlb_stats.refills++;
+
+  if ((tlb_load_tag[idx] & ~TLB_FLAGS) != expected_tag)
     tlb_load_tag[idx] = -1;
-  if ((tlb_store_tag[idx] & ~TLB_CHECK_TRIGGERS) != expected_tag)
+  if ((tlb_store_tag[idx] & ~TLB_FLAGS) != expected_tag)
     tlb_store_tag[idx] = -1;
-  if ((tlb_insn_tag[idx] & ~TLB_CHECK_TRIGGERS) != expected_tag)
+  if ((tlb_insn_tag[idx] & ~TLB_FLAGS) != expected_tag)
     tlb_insn_tag[idx] = -1;
 
   if ((check_triggers_fetch && type == FETCH) ||
       (check_triggers_load && type == LOAD) ||
       (check_triggers_store && type == STORE))
     expected_tag |= TLB_CHECK_TRIGGERS;
+  if (traced)
+    expected_tag |= TLB_CHECK_TRACER;
 
   if (type == FETCH) tlb_insn_tag[idx] = expected_tag;
   else if (type == STORE) tlb_store_tag[idx] = expected_tag;
   else tlb_load_tag[idx] = expected_tag;
 
-  enclave_id_t owner = ENCLAVE_INVALID_ID;
-  enclave_id_t reader = ENCLAVE_INVALID_ID;
-  if(paddr >= DRAM_BASE && paddr < DRAM_BASE + PGSIZE*num_of_pages) {
-    reg_t dram_offset = paddr - DRAM_BASE;
-    reg_t page_num = dram_offset / PGSIZE;
-    owner = tag_directory[page_num].owner;
-    reader = tag_directory[page_num].reader;
-  }
-  tlb_entry_t entry = {host_addr - vaddr, paddr - vaddr, owner, reader};
   tlb_data[idx] = entry;
   return entry;
 }
 
-reg_t mmu_t::walk(reg_t addr, access_type type, reg_t mode)
+bool mmu_t::walk(reg_t addr, access_type type, reg_t mode, reg_t* paddr)
 {
-  vm_info vm = decode_vm_info(proc->max_xlen, mode, proc->get_state()->satp);
-  if (vm.levels == 0)
-    return addr & ((reg_t(2) << (proc->xlen-1))-1); // zero-extend from xlen
+  reg_t satp = proc->get_state()->satp;
+  vm_info vm = decode_vm_info(proc->max_xlen, mode, satp);
+  if (vm.levels == 0) {
+    *paddr = addr & ((reg_t(2) << (proc->xlen-1))-1); // zero-extend from xlen
+    return true;
+  }
 
   bool s_mode = mode == PRV_S;
   bool sum = get_field(proc->state.mstatus, MSTATUS_SUM);
@@ -285,20 +702,42 @@ reg_t mmu_t::walk(reg_t addr, access_type type, reg_t mode)
   }
 
   reg_t base = vm.ptbase;
-  for (int i = vm.levels - 1; i >= 0; i--) {
+  int start = vm.levels - 1;
+  bool global = false;
+  tlb_stats.walks++;
+
+  // resume the walk from the deepest cached page table
+  for (int i = 0; i < vm.levels - 1; i++) {
+    reg_t va_prefix = addr >> (PGSHIFT + (i + 1) * vm.idxbits);
+    walk_cache_entry_t* entry = &walk_cache[i][va_prefix % WALK_CACHE_ENTRIES];
+    if (entry->satp == satp && entry->va_prefix == va_prefix) {
+      base = entry->base;
+      global = entry->global;
+      start = i;
+      tlb_stats.walk_cache_hits++;
+      break;
+    }
+  }
+
+  for (int i = start; i >= 0; i--) {
     int ptshift = i * vm.idxbits;
     reg_t idx = (addr >> (PGSHIFT + ptshift)) & ((1 << vm.idxbits) - 1);
 
     // check that physical address of PTE is legal
-    auto ppte = sim->addr_to_mem(base + idx * vm.ptesize);
+    check_concurrent_access(base + idx * vm.ptesize);
+    auto ppte = addr_to_mem(base + idx * vm.ptesize);
     if (!ppte)
       goto fail_access;
 
     reg_t pte = vm.ptesize == 4 ? *(uint32_t*)ppte : *(uint64_t*)ppte;
     reg_t ppn = pte >> PTE_PPN_SHIFT;
+    global |= (pte & PTE_G) != 0;
 
     if (PTE_TABLE(pte)) { // next level of page table
+      reg_t pte_paddr = base + idx * vm.ptesize;
       base = ppn << PGSHIFT;
+      if (i > 0)
+        refill_walk_cache(i - 1, addr >> (PGSHIFT + ptshift), satp, base, global, pte_paddr);
     } else if ((pte & PTE_U) ? s_mode && (type == FETCH || !sum) : !s_mode) {
       break;
     } else if (!(pte & PTE_V) || (!(pte & PTE_R) && (pte & PTE_W))) {
@@ -308,7 +747,7 @@ reg_t mmu_t::walk(reg_t addr, access_type type, reg_t mode)
 //       fprintf(stderr, "mmu.cc: level %d, pte 0x%016lx ppn 0x%016lx, idx 0x%016lx\n", i, pte, ppn, idx);
 //       fprintf(stderr, "ptbase 0x%016lx content: \n", vm.ptbase);
 //       for(int i = 0; i < 1024; i++) {
-//         fprintf(stderr, "%016lx ", ((uint64_t*) (sim->addr_to_mem(vm.ptbase)))[i]);
+//         fprintf(stderr, "%016lx ", ((uint64_t*) (addr_to_mem(vm.ptbase)))[i]);
 //       }
 //       fprintf(stderr, "\n");
 //       exit(-1); //TODO remove
@@ -332,16 +771,18 @@ reg_t mmu_t::walk(reg_t addr, access_type type, reg_t mode)
 #endif
       // for superpage mappings, make a fake leaf PTE for the TLB's benefit.
       reg_t vpn = addr >> PGSHIFT;
-      reg_t value = (ppn | (vpn & ((reg_t(1) << ptshift) - 1))) << PGSHIFT;
-      return value;
+      *paddr = (ppn | (vpn & ((reg_t(1) << ptshift) - 1))) << PGSHIFT;
+      walk_global = global;
+      walk_vpn_mask = (reg_t(1) << ptshift) - 1;
+      return true;
     }
   }
 
 fail:
   switch (type) {
-    case FETCH: throw trap_instruction_page_fault(addr);
-    case LOAD: throw trap_load_page_fault(addr);
-    case STORE: throw trap_store_page_fault(addr);
+    case FETCH: return record_fault(CAUSE_FETCH_PAGE_FAULT, addr);
+    case LOAD: return record_fault(CAUSE_LOAD_PAGE_FAULT, addr);
+    case STORE: return record_fault(CAUSE_STORE_PAGE_FAULT, addr);
     default: abort();
   }
 
@@ -350,10 +791,10 @@ fail_access:
   fprintf(stderr, "mmu.cc: Failed to access the page table in page walk.\n");
 #endif
   switch (type) {
-    case FETCH: throw trap_instruction_access_fault(addr);
-    case LOAD: throw trap_load_access_fault(addr);
+    case FETCH: return record_fault(CAUSE_FETCH_ACCESS, addr);
+    case LOAD: return record_fault(CAUSE_LOAD_ACCESS, addr);
     case STORE:
-      throw trap_store_access_fault(addr);
+      return record_fault(CAUSE_STORE_ACCESS, addr);
     default: abort();
   }
 }
@@ -362,4 +803,5 @@ void mmu_t::register_memtracer(memtracer_t* t)
 {
   flush_tlb();
   tracer.hook(t);
+  fetch_traced = tracer.interested_in_range(0, reg_t(-1), FETCH);
 }
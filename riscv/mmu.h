@@ -11,8 +11,10 @@
 #include "simif.h"
 #include "processor.h"
 #include "memtracer.h"
+#include "decode_cache.h"
 #include <stdlib.h>
 #include <vector>
+#include <set>
 
 // virtual memory configuration
 #define PGSHIFT 12
@@ -27,8 +29,25 @@ struct insn_fetch_t
 
 struct icache_entry_t {
   reg_t tag;
-  struct icache_entry_t* next;
   insn_fetch_t data;
+  reg_t paddr;
+};
+
+// A straight-line run of decoded instructions within one page. Only the
+// last instruction may change control flow, serialize or trap on purpose,
+// so the others can run back to back with only their faults to check for.
+static const size_t MAX_BLOCK_INSNS = 16;
+struct jit_context_t;
+typedef reg_t (*jit_func_t)(jit_context_t*);
+struct insn_block_t {
+  reg_t tag;
+  uint64_t generation; // icache_generation when the block was built
+  size_t length;
+  insn_fetch_t insns[MAX_BLOCK_INSNS];
+  uint32_t executions;
+  jit_func_t jit;      // host code for the first jit_length instructions
+  size_t jit_length;
+  reg_t jit_misa;      // misa the host code was generated for
 };
 
 struct tlb_entry_t {
@@ -36,6 +55,26 @@ struct tlb_entry_t {
   reg_t target_offset;
   enclave_id_t owner_id;
   enclave_id_t reader_id;
+  reg_t asid;
+  bool global;
+  reg_t vpn_mask; // vpn bits the leaf PTE spans, non-zero for superpages
+};
+
+struct tlb_stats_t {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t refills;
+  uint64_t walks;
+  uint64_t walk_cache_hits;
+};
+
+// A cached non-leaf PTE: the physical base of the page table that serves
+// level `level` of the walk for all addresses sharing the VA prefix above it.
+struct walk_cache_entry_t {
+  reg_t satp; // 0 (translation off) marks an empty entry
+  reg_t va_prefix;
+  reg_t base;
+  bool global; // a PTE above this table has the G bit set
 };
 
 class trigger_matched_t
@@ -51,22 +90,53 @@ class trigger_matched_t
     reg_t data;
 };
 
+// Thrown when a hart that runs concurrently with other harts is about to
+// touch state it shares with them. Nothing has been changed yet, so the
+// instruction is simply run again once the hart runs on its own.
+class concurrent_yield_t
+{
+};
+
+// A page or access fault an mmu_t::*_or_fault access returned instead of
+// throwing it.
+struct mem_fault_t
+{
+  reg_t cause;
+  reg_t tval;
+};
+
 // this class implements a processor's port into the virtual memory system.
 // an MMU and instruction cache are maintained for simulator performance.
-class mmu_t
+class mmu_t : public page_tag_listener_t
 {
 private:
   bool check_identifier(reg_t paddr, enclave_id_t id, bool load, enclave_id_t *writer_id = NULL);
 public:
-  mmu_t(simif_t* sim, processor_t* proc, page_tag_t *tag_directory, size_t num_pages);
+  mmu_t(simif_t* sim, processor_t* proc, tag_directory_t *tag_directory);
   ~mmu_t();
 
+  // the fault of the last access that failed without throwing
+  const mem_fault_t& get_fault() { return fault; }
+  // throw the fault of the last failed access as its trap class
+  [[noreturn]] void throw_fault();
+
   inline reg_t misaligned_load(reg_t addr, size_t size, enclave_id_t enclave_id)
   {
 #ifdef RISCV_ENABLE_MISALIGNED
     reg_t res = 0;
+    if (unlikely(check_triggers_load)) {
+      for (size_t i = 0; i < size; i++)
+        res += (reg_t)load_uint8(addr + i, enclave_id) << (i * 8);
+      return res;
+    }
+    // split the access into at most two pieces that do not cross a page
+    uint8_t bytes[sizeof(reg_t)];
+    size_t first = misaligned_first_piece(addr, size);
+    load_piece(addr, first, bytes, enclave_id);
+    if (first < size)
+      load_piece(addr + first, size - first, bytes + first, enclave_id);
     for (size_t i = 0; i < size; i++)
-      res += (reg_t)load_uint8(addr + i, enclave_id) << (i * 8);
+      res += (reg_t)bytes[i] << (i * 8);
     return res;
 #else
     throw trap_load_address_misaligned(addr);
@@ -76,49 +146,63 @@ public:
   inline void misaligned_store(reg_t addr, reg_t data, size_t size, enclave_id_t enclave_id)
   {
 #ifdef RISCV_ENABLE_MISALIGNED
+    if (unlikely(check_triggers_store)) {
+      for (size_t i = 0; i < size; i++)
+        store_uint8(addr + i, data >> (i * 8), enclave_id);
+      return;
+    }
+    uint8_t bytes[sizeof(reg_t)];
     for (size_t i = 0; i < size; i++)
-      store_uint8(addr + i, data >> (i * 8), enclave_id);
+      bytes[i] = data >> (i * 8);
+    size_t first = misaligned_first_piece(addr, size);
+    store_piece(addr, first, bytes, enclave_id);
+    if (first < size)
+      store_piece(addr + first, size - first, bytes + first, enclave_id);
 #else
     throw trap_store_address_misaligned(addr);
 #endif
   }
 
-  // template for functions that load an aligned value from memory
-  /*#define load_func(type) \
-    inline type##_t load_##type(reg_t addr, enclave_id_t enclave_id) { \
-      if (unlikely(addr & (sizeof(type##_t)-1))) \
-        return misaligned_load(addr, sizeof(type##_t), enclave_id); \
+  // template for functions that load an aligned value from memory. The
+  // _or_fault variant returns false on a page or access fault and leaves the
+  // fault in get_fault() instead of throwing it.
+  #define load_func(type) \
+    inline bool load_##type##_or_fault(reg_t addr, type##_t* res, enclave_id_t enclave_id) { \
+      if (unlikely(addr & (sizeof(type##_t)-1))) { \
+        *res = misaligned_load(addr, sizeof(type##_t), enclave_id); \
+        return true; \
+      } \
       reg_t vpn = addr >> PGSHIFT; \
-      if (likely(tlb_load_tag[vpn % TLB_ENTRIES] == vpn)) { \
-        if(likely( \
-          tlb_data[vpn % TLB_ENTRIES].owner_id  == enclave_id || \
-          tlb_data[vpn % TLB_ENTRIES].reader_id == enclave_id || \
-          tlb_data[vpn % TLB_ENTRIES].owner_id  == ENCLAVE_INVALID_ID \
-        )) { \
-          return *(type##_t*)(tlb_data[vpn % TLB_ENTRIES].host_offset + addr); \
-        } \
+      size_t idx = tlb_index(vpn); \
+      if (unlikely((tlb_load_tag[idx] & ~TLB_FLAGS) != vpn)) \
+        tlb_promote(vpn, idx, &tlb_load_tag[0]); \
+      tlb_entry_t* entry = &tlb_data[idx]; \
+      if (likely(tlb_load_tag[idx] == vpn) && \
+          likely(tlb_load_allowed(entry, enclave_id))) { \
+        tlb_stats.hits++; \
+        *res = *(type##_t*)(entry->host_offset + addr); \
+        return true; \
       } \
-      if (unlikely(tlb_load_tag[vpn % TLB_ENTRIES] == (vpn | TLB_CHECK_TRIGGERS))) { \
-        type##_t data = *(type##_t*)(tlb_data[vpn % TLB_ENTRIES].host_offset + addr); \
-        if (!matched_trigger) { \
+      if (unlikely((tlb_load_tag[idx] & ~TLB_FLAGS) == vpn) && \
+          tlb_load_allowed(entry, enclave_id)) { \
+        tlb_stats.hits++; \
+        type##_t data = *(type##_t*)(entry->host_offset + addr); \
+        if ((tlb_load_tag[idx] & TLB_CHECK_TRIGGERS) && !matched_trigger) { \
           matched_trigger = trigger_exception(OPERATION_LOAD, addr, data); \
           if (matched_trigger) \
             throw *matched_trigger; \
         } \
-        if(likely( \
-          tlb_data[vpn % TLB_ENTRIES].owner_id  == enclave_id || \
-          tlb_data[vpn % TLB_ENTRIES].reader_id == enclave_id || \
-          tlb_data[vpn % TLB_ENTRIES].owner_id  == ENCLAVE_INVALID_ID) \
-        ) { \
-          return data; \
-        } \
-      }*/
-  #define load_func(type) \
+        if (tlb_load_tag[idx] & TLB_CHECK_TRACER) \
+          trace_load(entry->target_offset + addr, sizeof(type##_t), ENCLAVE_INVALID_ID, enclave_id); \
+        *res = data; \
+        return true; \
+      } \
+      return load_slow_path(addr, sizeof(type##_t), (uint8_t*)res, enclave_id); \
+    } \
     inline type##_t load_##type(reg_t addr, enclave_id_t enclave_id) { \
-      if (unlikely(addr & (sizeof(type##_t)-1))) \
-        return misaligned_load(addr, sizeof(type##_t), enclave_id); \
       type##_t res; \
-      load_slow_path(addr, sizeof(type##_t), (uint8_t*)&res, enclave_id); \
+      if (unlikely(!load_##type##_or_fault(addr, &res, enclave_id))) \
+        throw_fault(); \
       return res; \
     }
 
@@ -134,41 +218,43 @@ public:
   load_func(int32)
   load_func(int64)
 
-  // template for functions that store an aligned value to memory
-  /*#define store_func(type) \
-    void store_##type(reg_t addr, type##_t val, enclave_id_t enclave_id) { \
-      if (unlikely(addr & (sizeof(type##_t)-1))) \
-        return misaligned_store(addr, val, sizeof(type##_t), enclave_id); \
+  // template for functions that store an aligned value to memory, with an
+  // _or_fault variant like load_func's
+  #define store_func(type) \
+    inline bool store_##type##_or_fault(reg_t addr, type##_t val, enclave_id_t enclave_id) { \
+      if (unlikely(addr & (sizeof(type##_t)-1))) { \
+        misaligned_store(addr, val, sizeof(type##_t), enclave_id); \
+        return true; \
+      } \
       reg_t vpn = addr >> PGSHIFT; \
-      if (likely(tlb_store_tag[vpn % TLB_ENTRIES] == vpn)) {\
-        if(likely( \
-          tlb_data[vpn % TLB_ENTRIES].owner_id  == enclave_id || \
-          tlb_data[vpn % TLB_ENTRIES].reader_id == enclave_id || \
-          tlb_data[vpn % TLB_ENTRIES].owner_id  == ENCLAVE_INVALID_ID \
-        )) {\
-          *(type##_t*)(tlb_data[vpn % TLB_ENTRIES].host_offset + addr) = val; \
-          return; \
-        } \
-      } else if (unlikely(tlb_store_tag[vpn % TLB_ENTRIES] == (vpn | TLB_CHECK_TRIGGERS))) { \
-        if (!matched_trigger) { \
+      size_t idx = tlb_index(vpn); \
+      if (unlikely((tlb_store_tag[idx] & ~TLB_FLAGS) != vpn)) \
+        tlb_promote(vpn, idx, &tlb_store_tag[0]); \
+      tlb_entry_t* entry = &tlb_data[idx]; \
+      if (likely(tlb_store_tag[idx] == vpn) && \
+          likely(tlb_store_allowed(entry, enclave_id))) { \
+        tlb_stats.hits++; \
+        *(type##_t*)(entry->host_offset + addr) = val; \
+        return true; \
+      } \
+      if (unlikely((tlb_store_tag[idx] & ~TLB_FLAGS) == vpn) && \
+          tlb_store_allowed(entry, enclave_id)) { \
+        tlb_stats.hits++; \
+        if ((tlb_store_tag[idx] & TLB_CHECK_TRIGGERS) && !matched_trigger) { \
           matched_trigger = trigger_exception(OPERATION_STORE, addr, val); \
           if (matched_trigger) \
             throw *matched_trigger; \
         } \
-        if(likely( \
-          tlb_data[vpn % TLB_ENTRIES].owner_id  == enclave_id || \
-          tlb_data[vpn % TLB_ENTRIES].reader_id == enclave_id || \
-          tlb_data[vpn % TLB_ENTRIES].owner_id  == ENCLAVE_INVALID_ID \
-        )) { \
-          *(type##_t*)(tlb_data[vpn % TLB_ENTRIES].host_offset + addr) = val; \
-          return; \
-        } \
-      }*/
-  #define store_func(type) \
+        *(type##_t*)(entry->host_offset + addr) = val; \
+        if (tlb_store_tag[idx] & TLB_CHECK_TRACER) \
+          tracer.trace(entry->target_offset + addr, sizeof(type##_t), STORE); \
+        return true; \
+      } \
+      return store_slow_path(addr, sizeof(type##_t), (const uint8_t*)&val, enclave_id); \
+    } \
     void store_##type(reg_t addr, type##_t val, enclave_id_t enclave_id) { \
-      if (unlikely(addr & (sizeof(type##_t)-1))) \
-        return misaligned_store(addr, val, sizeof(type##_t), enclave_id); \
-      store_slow_path(addr, sizeof(type##_t), (const uint8_t*)&val, enclave_id); \
+      if (unlikely(!store_##type##_or_fault(addr, val, enclave_id))) \
+        throw_fault(); \
     }
 
   // template for functions that perform an atomic memory operation
@@ -177,6 +263,12 @@ public:
     type##_t amo_##type(reg_t addr, op f, enclave_id_t enclave_id) { \
       if (addr & (sizeof(type##_t)-1)) \
         throw trap_store_address_misaligned(addr); \
+      if (auto host_addr = (type##_t*)amo_translate(addr, sizeof(type##_t), enclave_id)) { \
+        type##_t lhs = *host_addr; \
+        *host_addr = f(lhs); \
+        return lhs; \
+      } \
+      /* MMIO and trigger matching need separate load and store accesses */ \
       try { \
         auto lhs = load_##type(addr, enclave_id); \
         store_##type(addr, f(lhs), enclave_id); \
@@ -226,9 +318,11 @@ public:
 
   inline void acquire_load_reservation(reg_t vaddr)
   {
-    reg_t paddr = translate(vaddr, LOAD);
-    if (auto host_addr = sim->addr_to_mem(paddr))
-      load_reservation_address = refill_tlb(vaddr, paddr, host_addr, LOAD).target_offset + vaddr;
+    reg_t paddr;
+    if (!translate(vaddr, LOAD, &paddr))
+      throw_fault();
+    if (auto host_addr = addr_to_mem(paddr))
+      load_reservation_address = refill_tlb(vaddr, paddr, host_addr, LOAD, proc->get_enclave_id()).target_offset + vaddr;
     else {
 #ifdef PRAESIDIO_DEBUG
       fprintf(stderr, "mmu.h: throwing load access fault for address 0x%016lx\n", vaddr);
@@ -239,10 +333,15 @@ public:
 
   inline bool check_load_reservation(reg_t vaddr)
   {
-    reg_t paddr = translate(vaddr, STORE);
-    if (auto host_addr = sim->addr_to_mem(paddr))
-      return load_reservation_address == refill_tlb(vaddr, paddr, host_addr, STORE).target_offset + vaddr;
-    else
+    reg_t paddr;
+    if (!translate(vaddr, STORE, &paddr))
+      throw_fault();
+    if (auto host_addr = addr_to_mem(paddr)) {
+      if (load_reservation_address == refill_tlb(vaddr, paddr, host_addr, STORE, proc->get_enclave_id()).target_offset + vaddr)
+        return true;
+      shared_accesses++;
+      return false;
+    } else
       throw trap_store_access_fault(vaddr); // disallow SC to I/O space
   }
 
@@ -276,15 +375,13 @@ public:
       insn |= (insn_bits_t)*(const uint16_t*)translate_insn_addr_to_host(addr + 4, enclave_id) << 32;
       insn |= (insn_bits_t)*(const uint16_t*)translate_insn_addr_to_host(addr + 2, enclave_id) << 16;
     }
-    insn_fetch_t fetch = {proc->decode_insn(insn), insn};
+    cache_code_page(paddr >> PGSHIFT);
+    if (unlikely((paddr & (PGSIZE - 1)) + length > PGSIZE))
+      cache_code_page((translate_insn_addr(addr + length - 1, enclave_id).target_offset + addr + length - 1) >> PGSHIFT);
+    insn_fetch_t fetch = {decode_insn(paddr, insn), insn};
     entry->tag = addr;
-    entry->next = &icache[icache_index(addr + length)];
     entry->data = fetch;
-
-    if (tracer.interested_in_range(paddr, paddr + 1, FETCH)) {
-      entry->tag = -1;
-      tracer.trace(paddr, length, FETCH);
-    }
+    entry->paddr = paddr;
     return entry;
   }
 
@@ -296,10 +393,66 @@ public:
     return refill_icache(addr, entry, enclave_id);
   }
 
+  static const reg_t BLOCK_CACHE_ENTRIES = 512;
+
+  // return the basic block starting at addr, or NULL if the instruction at
+  // addr may not be fetched by the enclave
+  inline insn_block_t* access_block(reg_t addr, enclave_id_t enclave_id)
+  {
+    insn_block_t* block = &blocks[(addr / PC_ALIGN) % BLOCK_CACHE_ENTRIES];
+    if (likely(block->tag == addr && block->generation == icache_generation))
+      return block;
+    return refill_block(addr, block, enclave_id);
+  }
+
+  // retire all blocks, e.g. because the host code attached to them is
+  // about to be overwritten
+  void retire_blocks() { icache_generation++; }
+
+  // Load or store len bytes at an aligned addr if that only needs a plain
+  // TLB hit. Returns false, without architectural side effects, if the
+  // access has to go through load_slow_path or store_slow_path; the TLB set
+  // may still have been reordered and tlb_stats only count hits.
+  inline bool try_load(reg_t addr, reg_t len, void* data, enclave_id_t enclave_id)
+  {
+    if (unlikely(addr & (len - 1)))
+      return false;
+    reg_t vpn = addr >> PGSHIFT;
+    size_t idx = tlb_index(vpn);
+    if (unlikely((tlb_load_tag[idx] & ~TLB_FLAGS) != vpn))
+      tlb_promote(vpn, idx, &tlb_load_tag[0]);
+    tlb_entry_t* entry = &tlb_data[idx];
+    if (likely(tlb_load_tag[idx] == vpn) && likely(tlb_load_allowed(entry, enclave_id))) {
+      tlb_stats.hits++;
+      memcpy(data, entry->host_offset + addr, len);
+      return true;
+    }
+    return false;
+  }
+
+  inline bool try_store(reg_t addr, reg_t len, const void* data, enclave_id_t enclave_id)
+  {
+    if (unlikely(addr & (len - 1)))
+      return false;
+    reg_t vpn = addr >> PGSHIFT;
+    size_t idx = tlb_index(vpn);
+    if (unlikely((tlb_store_tag[idx] & ~TLB_FLAGS) != vpn))
+      tlb_promote(vpn, idx, &tlb_store_tag[0]);
+    tlb_entry_t* entry = &tlb_data[idx];
+    if (likely(tlb_store_tag[idx] == vpn) && likely(tlb_store_allowed(entry, enclave_id))) {
+      tlb_stats.hits++;
+      memcpy(entry->host_offset + addr, data, len);
+      return true;
+    }
+    return false;
+  }
+
   inline insn_fetch_t load_insn(reg_t addr, enclave_id_t enclave_id)
   {
     icache_entry_t entry;
     if(refill_icache(addr, &entry, enclave_id)) {
+      if (fetch_traced)
+        trace_fetch(&entry);
       return entry.data;
     }
 #ifdef PRAESIDIO_DEBUG
@@ -308,11 +461,62 @@ public:
     throw trap_illegal_instruction(0);
   }
 
+  // Share a decoded-instruction store with other harts. Harts given the
+  // same decode_class must decode every instruction identically at equal
+  // XLEN.
+  void set_decode_cache(decode_cache_t* cache, reg_t decode_class);
+
   void flush_tlb();
   void flush_icache();
 
+  // make stores to instruction memory visible to this hart's fetches.
+  // Only decoded instructions on pages written since they were cached are
+  // dropped.
+  void fence_i();
+  // called by the simulator when any store writes the physical page ppn
+  void code_page_written(reg_t ppn);
+  // drop the store translations of physical page ppn, so that stores to it
+  // take the slow path
+  void drop_store_translations(reg_t ppn);
+  void flush_walk_cache();
+
+  // While concurrent, this hart runs alongside the harts of other enclaves
+  // and may only access DRAM pages owned by enclave_id, its enclave for the
+  // whole concurrent period. Accesses to anything else, MMIO included, and
+  // updates of state shared with other harts throw concurrent_yield_t.
+  // Releases of code pages are deferred until end_concurrent.
+  void begin_concurrent(enclave_id_t enclave_id);
+  void end_concurrent();
+  bool is_concurrent() { return concurrent; }
+
+  // invalidate the translations selected by the operands of sfence.vma.
+  // Decoded instructions are only dropped when their translation may have
+  // changed.
+  void sfence_vma(reg_t vaddr, bool all_addresses, reg_t asid, bool all_asids);
+
+  // resize the TLB to the given number of entries and ways; both must be
+  // powers of two. The TLB is flushed.
+  void set_tlb_geometry(size_t entries, size_t ways);
+  size_t get_tlb_entries() { return tlb_data.size(); }
+  size_t get_tlb_ways() { return tlb_ways; }
+  const tlb_stats_t& get_tlb_stats() { return tlb_stats; }
+  // loads from pages shared by another enclave and failed store-conditionals
+  // so far, the signs of harts communicating used by the adaptive quantum
+  uint64_t get_shared_accesses() { return shared_accesses; }
+
+  // drop the TLB and icache entries that map the retagged DRAM page
+  void page_tag_changed(size_t page_num);
+
   void register_memtracer(memtracer_t*);
 
+  // Whether fetches are reported to a memtracer. Decoded instructions stay
+  // cached, so the fetch loop reports every executed instruction itself.
+  bool fetch_traced;
+  inline void trace_fetch(icache_entry_t* entry)
+  {
+    tracer.trace(entry->paddr, entry->data.insn.length(), FETCH);
+  }
+
   int is_dirty_enabled()
   {
 #ifdef RISCV_ENABLE_DIRTY
@@ -337,48 +541,290 @@ private:
   memtracer_list_t tracer;
   reg_t load_reservation_address;
   uint16_t fetch_temp;
-  page_tag_t *tag_directory;
+  tag_directory_t *tag_directory;
   size_t num_of_pages;
 
+  // the RAM region of the last physical address looked up by this hart
+  bus_region_t last_mem_region;
+
+  // per-hart front end for sim->addr_to_mem; NULL for MMIO addresses
+  inline char* addr_to_mem(reg_t paddr)
+  {
+    if (unlikely(!last_mem_region.contains(paddr))) {
+      bus_region_t region = sim->find_mem_region(paddr);
+      if (!region.is_ram())
+        return NULL;
+      last_mem_region = region;
+    }
+    return last_mem_region.mem + (paddr - last_mem_region.base);
+  }
+
   // implement an instruction cache for simulator performance
   icache_entry_t icache[ICACHE_ENTRIES];
 
-  // implement a TLB for simulator performance
-  static const reg_t TLB_ENTRIES = 256;
+  // Basic blocks are built from icache entries. Rather than tracking which
+  // blocks hold which entries, every invalidation of icache entries bumps
+  // icache_generation, which retires all blocks at once.
+  insn_block_t blocks[BLOCK_CACHE_ENTRIES];
+  uint64_t icache_generation;
+  insn_block_t* refill_block(reg_t addr, insn_block_t* block, enclave_id_t enclave_id);
+
+  // Physical pages that instructions in the icache were fetched from, and
+  // those of them written since. Every hart keeps stores to pages cached by
+  // any hart out of its store TLB, so that the simulator sees them.
+  std::set<reg_t> icache_pages;
+  std::set<reg_t> dirty_code_pages;
+  reg_t last_code_page;
+
+  inline void cache_code_page(reg_t ppn)
+  {
+    if (likely(ppn == last_code_page))
+      return;
+    if (unlikely(concurrent) && !icache_pages.count(ppn))
+      throw concurrent_yield_t();
+    last_code_page = ppn;
+    if (icache_pages.insert(ppn).second)
+      sim->code_page_cached(ppn);
+  }
+  void release_code_page(reg_t ppn);
+
+  bool concurrent;
+  enclave_id_t concurrent_enclave_id;
+  std::vector<reg_t> released_code_pages;
+
+  inline void check_concurrent_access(reg_t paddr)
+  {
+    if (unlikely(concurrent) && !concurrent_private(paddr))
+      throw concurrent_yield_t();
+  }
+  inline bool concurrent_private(reg_t paddr)
+  {
+    return paddr >= DRAM_BASE && paddr < DRAM_BASE + PGSIZE * num_of_pages &&
+           tag_directory->get((paddr - DRAM_BASE) / PGSIZE).owner == concurrent_enclave_id;
+  }
+
+  // optional decoded-instruction store shared between harts, bypassed
+  // while concurrent
+  decode_cache_t* decode_cache;
+  reg_t decode_class;
+
+  inline insn_func_t decode_insn(reg_t paddr, insn_bits_t insn)
+  {
+    if (!decode_cache || concurrent)
+      return proc->decode_insn(insn);
+    reg_t config = (decode_class << 8) | proc->get_xlen();
+    insn_func_t func = decode_cache->lookup(paddr, insn, config);
+    if (unlikely(!func)) {
+      func = proc->decode_insn(insn);
+      decode_cache->insert(paddr, insn, config, func);
+    }
+    return func;
+  }
+
+  // implement a TLB for simulator performance. The TLB is set-associative
+  // with the ways of a set stored next to each other. Each set is kept in
+  // most-recently-used order, so the inline fast paths only probe the first
+  // way and a refill evicts the last one.
+  static const size_t DEFAULT_TLB_ENTRIES = 256;
+  static const size_t DEFAULT_TLB_WAYS = 1;
   // If a TLB tag has TLB_CHECK_TRIGGERS set, then the MMU must check for a
   // trigger match before completing an access.
   static const reg_t TLB_CHECK_TRIGGERS = reg_t(1) << 63;
-  tlb_entry_t tlb_data[TLB_ENTRIES];
-  reg_t tlb_insn_tag[TLB_ENTRIES];
-  reg_t tlb_load_tag[TLB_ENTRIES];
-  reg_t tlb_store_tag[TLB_ENTRIES];
+  // If a TLB tag has TLB_CHECK_TRACER set, then the access must be reported
+  // to the memtracers after it completes.
+  static const reg_t TLB_CHECK_TRACER = reg_t(1) << 62;
+  static const reg_t TLB_FLAGS = TLB_CHECK_TRIGGERS | TLB_CHECK_TRACER;
+  size_t tlb_ways;
+  unsigned tlb_ways_shift;
+  reg_t tlb_set_mask;
+  std::vector<tlb_entry_t> tlb_data;
+  std::vector<reg_t> tlb_insn_tag;
+  std::vector<reg_t> tlb_load_tag;
+  std::vector<reg_t> tlb_store_tag;
+  tlb_stats_t tlb_stats;
+  uint64_t shared_accesses;
+
+  // index of the first (most recently used) way of the set holding vpn
+  inline size_t tlb_index(reg_t vpn)
+  {
+    return (vpn & tlb_set_mask) << tlb_ways_shift;
+  }
+
+  // the virtual page TLB entry i translates, or false if it is invalid. All
+  // valid tags of an entry refer to the same virtual page.
+  inline bool tlb_entry_vpn(size_t i, reg_t* vpn)
+  {
+    reg_t tag = tlb_load_tag[i];
+    if (tag == reg_t(-1))
+      tag = tlb_store_tag[i];
+    if (tag == reg_t(-1))
+      tag = tlb_insn_tag[i];
+    if (tag == reg_t(-1))
+      return false;
+    *vpn = tag & ~TLB_FLAGS;
+    return true;
+  }
+
+  // look for vpn in the other ways of the set starting at idx; on a hit the
+  // way is moved to the front of the set
+  bool tlb_promote(reg_t vpn, size_t idx, const reg_t* tags);
+  void tlb_move_to_front(size_t idx, size_t way);
+
+  // implement a page-walk cache of intermediate page tables, so a TLB miss
+  // only has to read the leaf PTE. Stores by this hart to a page holding a
+  // cached PTE take the slow path and invalidate the cache; other changes
+  // require an sfence.vma, as they do on hardware with a walk cache.
+  static const size_t WALK_CACHE_LEVELS = 5; // non-leaf levels of Sv64
+  static const size_t WALK_CACHE_ENTRIES = 64;
+  walk_cache_entry_t walk_cache[WALK_CACHE_LEVELS][WALK_CACHE_ENTRIES];
+  std::set<reg_t> walk_cache_pages; // physical pages holding cached PTEs
+
+  void refill_walk_cache(int level, reg_t va_prefix, reg_t satp, reg_t base, bool global, reg_t pte_paddr);
+
+  // whether the last walk() ended in a global mapping, and the vpn bits
+  // its leaf PTE spans; used by refill_tlb
+  bool walk_global;
+  reg_t walk_vpn_mask;
+  // vpn bits spanned by any leaf the ITLB was refilled from since the TLB
+  // was last flushed, i.e. how far a decoded instruction's translation may
+  // reach beyond its own page
+  reg_t fetch_vpn_mask;
+
+  // drop decoded instructions whose page no longer has the same ITLB
+  // translation it was fetched through
+  void flush_unmapped_icache();
 
   // finish translation on a TLB miss and update the TLB
-  tlb_entry_t refill_tlb(reg_t vaddr, reg_t paddr, char* host_addr, access_type type);
+  tlb_entry_t refill_tlb(reg_t vaddr, reg_t paddr, char* host_addr, access_type type, enclave_id_t enclave_id);
+
+  // Ownership checks for accesses that hit in the TLB. These mirror
+  // check_identifier(): loads are allowed for the owner and the reader of a
+  // page, stores only for the owner. Pages outside DRAM carry no tag and are
+  // cached with the refilling enclave as owner, so a different enclave on
+  // this hart takes the slow path once and refills the entry.
+  inline bool tlb_load_allowed(const tlb_entry_t* entry, enclave_id_t enclave_id)
+  {
+    return entry->owner_id == enclave_id || entry->reader_id == enclave_id;
+  }
+
+  inline bool tlb_store_allowed(const tlb_entry_t* entry, enclave_id_t enclave_id)
+  {
+    return entry->owner_id == enclave_id;
+  }
   const char* fill_from_mmio(reg_t vaddr, reg_t paddr);
 
-  // perform a page table walk for a given VA; set referenced/dirty bits
-  reg_t walk(reg_t addr, access_type type, reg_t prv);
+  // perform a page table walk for a given VA; set referenced/dirty bits.
+  // Returns false and records the fault if the access is not allowed.
+  bool walk(reg_t addr, access_type type, reg_t prv, reg_t* paddr);
+
+  // number of bytes of a misaligned access that fall in its first page
+  inline size_t misaligned_first_piece(reg_t addr, size_t size)
+  {
+    reg_t to_page_end = PGSIZE - (addr & (PGSIZE - 1));
+    return size < to_page_end ? size : to_page_end;
+  }
+
+  // Access a piece of a misaligned access that lies within one page with a
+  // single translation and copy. Pieces are reported to the memtracers as
+  // one access.
+  inline void load_piece(reg_t addr, reg_t len, uint8_t* bytes, enclave_id_t enclave_id)
+  {
+    reg_t vpn = addr >> PGSHIFT;
+    size_t idx = tlb_index(vpn);
+    if (unlikely((tlb_load_tag[idx] & ~TLB_FLAGS) != vpn))
+      tlb_promote(vpn, idx, &tlb_load_tag[0]);
+    tlb_entry_t* entry = &tlb_data[idx];
+    if (likely((tlb_load_tag[idx] & ~TLB_CHECK_TRACER) == vpn) &&
+        likely(tlb_load_allowed(entry, enclave_id))) {
+      tlb_stats.hits++;
+      memcpy(bytes, entry->host_offset + addr, len);
+      if (unlikely(tlb_load_tag[idx] & TLB_CHECK_TRACER))
+        trace_load(entry->target_offset + addr, len, ENCLAVE_INVALID_ID, enclave_id);
+      return;
+    }
+    if (!load_slow_path(addr, len, bytes, enclave_id))
+      throw_fault();
+  }
+
+  inline void store_piece(reg_t addr, reg_t len, const uint8_t* bytes, enclave_id_t enclave_id)
+  {
+    reg_t vpn = addr >> PGSHIFT;
+    size_t idx = tlb_index(vpn);
+    if (unlikely((tlb_store_tag[idx] & ~TLB_FLAGS) != vpn))
+      tlb_promote(vpn, idx, &tlb_store_tag[0]);
+    tlb_entry_t* entry = &tlb_data[idx];
+    if (likely((tlb_store_tag[idx] & ~TLB_CHECK_TRACER) == vpn) &&
+        likely(tlb_store_allowed(entry, enclave_id))) {
+      tlb_stats.hits++;
+      memcpy(entry->host_offset + addr, bytes, len);
+      if (unlikely(tlb_store_tag[idx] & TLB_CHECK_TRACER))
+        tracer.trace(entry->target_offset + addr, len, STORE);
+      return;
+    }
+    if (!store_slow_path(addr, len, bytes, enclave_id))
+      throw_fault();
+  }
+
+  // Translate an AMO once, with store permission, and return the host
+  // address to modify in place. Returns NULL if the AMO has to be performed
+  // as a separate load and store, i.e. for MMIO or when triggers are set.
+  inline char* amo_translate(reg_t addr, reg_t len, enclave_id_t enclave_id)
+  {
+    reg_t vpn = addr >> PGSHIFT;
+    size_t idx = tlb_index(vpn);
+    if (unlikely((tlb_store_tag[idx] & ~TLB_FLAGS) != vpn))
+      tlb_promote(vpn, idx, &tlb_store_tag[0]);
+    tlb_entry_t* entry = &tlb_data[idx];
+    if (likely((tlb_store_tag[idx] & ~TLB_CHECK_TRACER) == vpn) &&
+        likely(tlb_store_allowed(entry, enclave_id))) {
+      tlb_stats.hits++;
+      if (unlikely(tlb_store_tag[idx] & TLB_CHECK_TRACER))
+        tracer.trace(entry->target_offset + addr, len, STORE);
+      return entry->host_offset + addr;
+    }
+    return amo_slow_path(addr, len, enclave_id);
+  }
+  char* amo_slow_path(reg_t addr, reg_t len, enclave_id_t enclave_id);
+
+  // report a data load to the memtracers; writer_id is the owner of the page
+  // if it was read as its reader
+  void trace_load(reg_t paddr, reg_t len, enclave_id_t writer_id, enclave_id_t enclave_id);
 
   // handle uncommon cases: TLB misses, page faults, MMIO
   tlb_entry_t fetch_slow_path(reg_t addr, enclave_id_t id);
-  void load_slow_path(reg_t addr, reg_t len, uint8_t* bytes, enclave_id_t id);
-  void store_slow_path(reg_t addr, reg_t len, const uint8_t* bytes, enclave_id_t id);
-  reg_t translate(reg_t addr, access_type type);
+  // The load and store slow paths and translate() return false and record
+  // the fault on page and access faults; other traps are still thrown.
+  bool load_slow_path(reg_t addr, reg_t len, uint8_t* bytes, enclave_id_t id);
+  bool store_slow_path(reg_t addr, reg_t len, const uint8_t* bytes, enclave_id_t id);
+  bool translate(reg_t addr, access_type type, reg_t* paddr);
+
+  mem_fault_t fault;
+  bool record_fault(reg_t cause, reg_t tval)
+  {
+    fault.cause = cause;
+    fault.tval = tval;
+    return false;
+  }
 
   // ITLB lookup
   inline tlb_entry_t translate_insn_addr(reg_t addr, enclave_id_t enclave_id) {
     reg_t vpn = addr >> PGSHIFT;
-    if (likely(tlb_insn_tag[vpn % TLB_ENTRIES] == vpn))
-      return tlb_data[vpn % TLB_ENTRIES];
+    size_t idx = tlb_index(vpn);
+    if (unlikely((tlb_insn_tag[idx] & ~TLB_FLAGS) != vpn))
+      tlb_promote(vpn, idx, &tlb_insn_tag[0]);
+    if (likely(tlb_insn_tag[idx] == vpn)) {
+      tlb_stats.hits++;
+      return tlb_data[idx];
+    }
     tlb_entry_t result;
-    if (unlikely(tlb_insn_tag[vpn % TLB_ENTRIES] != (vpn | TLB_CHECK_TRIGGERS))) {
+    if (unlikely(tlb_insn_tag[idx] != (vpn | TLB_CHECK_TRIGGERS))) {
       result = fetch_slow_path(addr, enclave_id);
     } else {
-      result = tlb_data[vpn % TLB_ENTRIES];
+      tlb_stats.hits++;
+      result = tlb_data[idx];
     }
-    if (unlikely(tlb_insn_tag[vpn % TLB_ENTRIES] == (vpn | TLB_CHECK_TRIGGERS))) {
-      uint16_t* ptr = (uint16_t*)(tlb_data[vpn % TLB_ENTRIES].host_offset + addr);
+    if (unlikely(tlb_insn_tag[idx] == (vpn | TLB_CHECK_TRIGGERS))) {
+      uint16_t* ptr = (uint16_t*)(tlb_data[idx].host_offset + addr);
       int match = proc->trigger_match(OPERATION_EXECUTE, addr, *ptr);
       if (match >= 0) {
         throw trigger_matched_t(match, OPERATION_EXECUTE, addr, *ptr);
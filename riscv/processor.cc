@@ -8,6 +8,8 @@
 #include "simif.h"
 #include "mmu.h"
 #include "disasm.h"
+#include "jit.h"
+#include "host_fp.h"
 #include <cinttypes>
 #include <cmath>
 #include <cstdlib>
@@ -22,15 +24,15 @@
 #define STATE state
 
 processor_t::processor_t(const char* isa, simif_t* sim, uint32_t id,
-        enclave_id_t e_id, page_tag_t *tag_directory, size_t num_of_pages, bool halt_on_reset)
-  : debug(false), halt_request(false), sim(sim), ext(NULL), id(id), tag_directory(tag_directory), num_of_pages(num_of_pages),
+        enclave_id_t e_id, tag_directory_t *tag_directory, bool halt_on_reset)
+  : debug(false), halt_request(false), sim(sim), ext(NULL), id(id), jit(NULL), unfinished_steps(0), stopped_at_wfi(false), tag_directory(tag_directory),
   halt_on_reset(halt_on_reset), last_pc(1), executions(1)
 {
   enclave_id = e_id;
   parse_isa_string(isa);
   register_base_instructions();
 
-  mmu = new mmu_t(sim, this, tag_directory, num_of_pages);
+  mmu = new mmu_t(sim, this, tag_directory);
 
   disassembler = new disassembler_t(max_xlen);
   if (ext)
@@ -44,6 +46,7 @@ processor_t::~processor_t()
 {
   output_histogram();
 
+  delete jit;
   delete mmu;
   delete disassembler;
 }
@@ -157,6 +160,17 @@ void processor_t::set_histogram(bool value)
 #endif
 }
 
+void processor_t::set_jit(bool value)
+{
+  delete jit;
+  jit = NULL;
+  if (value && jit_t::supported()) {
+    jit = new jit_t(this);
+    jit->context.xpr = const_cast<reg_t*>(&state.XPR[0]);
+    jit->context.mmu = mmu;
+  }
+}
+
 void processor_t::reset()
 {
   state.reset(max_isa);
@@ -251,6 +265,23 @@ void processor_t::enter_debug_mode(uint8_t cause)
   state.pc = DEBUG_ROM_ENTRY;
 }
 
+reg_t processor_t::set_pending_mem_fault(reg_t epc)
+{
+  const mem_fault_t& fault = mmu->get_fault();
+  return set_pending_trap(fault.cause, fault.tval, epc);
+}
+
+void processor_t::take_pending_trap()
+{
+  pending_trap_t t(state.pending_trap_cause, state.pending_trap_tval);
+  take_trap(t, state.pending_trap_epc);
+
+  if (unlikely(state.single_step == state.STEP_STEPPED)) {
+    state.single_step = state.STEP_NONE;
+    enter_debug_mode(DCSR_CAUSE_STEP);
+  }
+}
+
 void processor_t::take_trap(trap_t& t, reg_t epc)
 {
   if (debug) {
@@ -337,9 +368,49 @@ int processor_t::paddr_bits()
   return max_xlen == 64 ? 50 : 34;
 }
 
+// Writes to these CSRs act on the simulator or other harts, so they are
+// not performed while harts run concurrently.
+static bool csr_affects_other_harts(int which)
+{
+  switch (which) {
+#ifdef BARE_METAL_OUTPUT_CSR
+    case CSR_BAREMETALOUTPUT:
+    case CSR_BAREMETALEXIT:
+    case CSR_BAREMETALSTATS:
+#endif //BARE_METAL_OUTPUT_CSR
+#ifdef ENCLAVE_PAGE_COMMUNICATION_SYSTEM
+    case CSR_ENCLAVEASSIGNREADER:
+#endif //ENCLAVE_PAGE_COMMUNICATION_SYSTEM
+#ifdef MANAGEMENT_SHIM_INSTRUCTIONS
+    case CSR_MANAGEENCLAVEID:
+    case CSR_MANAGECHANGEPAGETAG:
+#endif //MANAGEMENT_SHIM_INSTRUCTIONS
+      return true;
+    default:
+      return false;
+  }
+}
+
+#ifdef HOST_FP_ENABLED
+__thread __attribute__((tls_model("initial-exec"))) uint32_t host_fp_mode;
+#endif
+
+void processor_t::take_host_fp_flags()
+{
+  uint_fast8_t flags = host_fp_take_flags();
+  if (flags) {
+    dirty_fp_state;
+    state.fflags |= flags;
+  }
+}
+
 void processor_t::set_csr(int which, reg_t val)
 {
   val = zext_xlen(val);
+  if (unlikely(mmu->is_concurrent()) && csr_affects_other_harts(which))
+    throw concurrent_yield_t();
+  // fflags must be complete before it is read or replaced
+  take_host_fp_flags();
   reg_t delegable_ints = MIP_SSIP | MIP_STIP | MIP_SEIP
                        | ((ext != NULL) << IRQ_COP);
   reg_t all_ints = delegable_ints | MIP_MSIP | MIP_MTIP;
@@ -448,16 +519,29 @@ void processor_t::set_csr(int which, reg_t val)
       return set_csr(CSR_MIE,
                      (state.mie & ~state.mideleg) | (val & state.mideleg));
     case CSR_SATP: {
-      mmu->flush_tlb();
+      reg_t old_satp = state.satp;
+      reg_t asid_mask = max_xlen == 32 ? SATP32_ASID : SATP64_ASID;
+      reg_t mode_mask = max_xlen == 32 ? SATP32_MODE : SATP64_MODE;
       if (max_xlen == 32)
-        state.satp = val & (SATP32_PPN | SATP32_MODE);
+        state.satp = val & (SATP32_PPN | SATP32_ASID | SATP32_MODE);
 
       if (max_xlen == 64 && (get_field(val, SATP64_MODE) == SATP_MODE_OFF ||
                              get_field(val, SATP64_MODE) == SATP_MODE_SV39 ||
                              get_field(val, SATP64_MODE) == SATP_MODE_SV48)) {
-        state.satp = val & (SATP64_PPN | SATP64_MODE);
+        state.satp = val & (SATP64_PPN | SATP64_ASID | SATP64_MODE);
       }
 
+      // The TLB only holds translations of the current address space, so
+      // switching address spaces drops the non-global ones. Changing the
+      // translation mode invalidates everything.
+      if (state.satp != old_satp) {
+        if ((state.satp ^ old_satp) & mode_mask) {
+          mmu->flush_tlb();
+          mmu->flush_walk_cache();
+        } else {
+          mmu->sfence_vma(0, true, get_field(old_satp, asid_mask), false);
+        }
+      }
       break;
     }
     case CSR_SEPC: state.sepc = val & ~(reg_t)1; break;
@@ -554,20 +638,22 @@ void processor_t::set_csr(int which, reg_t val)
       break;
     case CSR_BAREMETALSTATS:
       sim->output_stats(val);
+      // the statistics use host floating point, which is not the hart's
+      host_fp_take_flags();
       break;
 #endif //BARE_METAL_OUTPUT_CSR
 #ifdef ENCLAVE_PAGE_COMMUNICATION_SYSTEM
     case CSR_ENCLAVEASSIGNREADER:
       //least significant 16-bits are the enclave ID the rest is page number.
-      if(enclave_id == tag_directory[val].owner) {//TODO check if val is not out of bounds
+      if(enclave_id == tag_directory->get(val).owner) {//TODO check if val is not out of bounds
 #ifdef PRAESIDIO_DEBUG
         fprintf(stderr, "processor.cc: Adding reader %u to page %lu.\n", state.arg_enclave_id, val);
 #endif //PRAESIDIO_DEBUG
-        tag_directory[val].reader = state.arg_enclave_id;
+        tag_directory->set_reader(val, state.arg_enclave_id);
       }
 #ifdef PRAESIDIO_DEBUG
       else {
-        fprintf(stderr, "proseccor.cc: WARNING failed to assign page %lu with reader %u, because owner is 0x%08x and you are 0x%08x.\n", val, state.arg_enclave_id, tag_directory[val].owner, enclave_id);
+        fprintf(stderr, "proseccor.cc: WARNING failed to assign page %lu with reader %u, because owner is 0x%08x and you are 0x%08x.\n", val, state.arg_enclave_id, tag_directory->get(val).owner, enclave_id);
       }
 #endif //PRAESIDIO_DEBUG
       state.arg_enclave_id = ENCLAVE_INVALID_ID;
@@ -600,7 +686,7 @@ void processor_t::set_csr(int which, reg_t val)
 #ifdef PRAESIDIO_DEBUG
           fprintf(stderr, "processor.cc: Changing page %d to tag: %u\n", index, state.arg_enclave_id);
 #endif //PRAESIDIO_DEBUG
-          tag_directory[index].owner = state.arg_enclave_id;
+          tag_directory->set_owner(index, state.arg_enclave_id);
         } else {
           //TODO enable tagging for pages in boot ROM and management pages.
 #ifdef PRAESIDIO_DEBUG
@@ -623,6 +709,17 @@ void processor_t::set_csr(int which, reg_t val)
 
 reg_t processor_t::get_csr(int which)
 {
+  bool legal;
+  reg_t value = get_csr(which, &legal);
+  if (!legal)
+    throw trap_illegal_instruction(0);
+  return value;
+}
+
+reg_t processor_t::get_csr(int which, bool* legal)
+{
+  *legal = true;
+  take_host_fp_flags();
   uint32_t ctr_en = -1;
   if (state.prv < PRV_M)
     ctr_en &= state.mcounteren;
@@ -680,18 +777,15 @@ reg_t processor_t::get_csr(int which)
   switch (which)
   {
     case CSR_FFLAGS:
-      require_fp;
-      if (!supports_extension('F'))
+      if (!(state.mstatus & MSTATUS_FS) || !supports_extension('F'))
         break;
       return state.fflags;
     case CSR_FRM:
-      require_fp;
-      if (!supports_extension('F'))
+      if (!(state.mstatus & MSTATUS_FS) || !supports_extension('F'))
         break;
       return state.frm;
     case CSR_FCSR:
-      require_fp;
-      if (!supports_extension('F'))
+      if (!(state.mstatus & MSTATUS_FS) || !supports_extension('F'))
         break;
       return (state.fflags << FSR_AEXC_SHIFT) | (state.frm << FSR_RD_SHIFT);
     case CSR_INSTRET:
@@ -733,8 +827,8 @@ reg_t processor_t::get_csr(int which)
         return state.scause | ((state.scause >> (max_xlen-1)) << (xlen-1));
       return state.scause;
     case CSR_SATP:
-      if (get_field(state.mstatus, MSTATUS_TVM))
-        require_privilege(PRV_M);
+      if (get_field(state.mstatus, MSTATUS_TVM) && state.prv < PRV_M)
+        break;
       return state.satp;
     case CSR_SSCRATCH: return state.sscratch;
     case CSR_MSTATUS: return state.mstatus;
@@ -809,44 +903,31 @@ reg_t processor_t::get_csr(int which)
   if(which != CSR_TIME)
     fprintf(stderr, "processor.cc: get_csr illegal instruction CSR: %d PC: 0x%016lx.\n", which, state.pc);
 #endif
-  throw trap_illegal_instruction(0);
+  *legal = false;
+  return 0;
 }
 
 reg_t illegal_instruction(processor_t* p, insn_t insn, reg_t pc)
 {
 #ifdef PRAESIDIO_DEBUG
-  fprintf(stderr, "processor.cc: throwing illegal instruction at pc 0x%016lx : 0x%016lx\n", pc, insn.bits());
+  fprintf(stderr, "processor.cc: illegal instruction at pc 0x%016lx : 0x%016lx\n", pc, insn.bits());
 #endif
-  throw trap_illegal_instruction(0);
+  raise_trap(CAUSE_ILLEGAL_INSTRUCTION, 0);
 }
 
 insn_func_t processor_t::decode_insn(insn_t insn)
 {
-  // look up opcode in hash table
-  size_t idx = insn.bits() % OPCODE_CACHE_SIZE;
-  insn_desc_t desc = opcode_cache[idx];
-
-  if (unlikely(insn.bits() != desc.match)) {
-    // fall back to linear search
-    insn_desc_t* p = &instructions[0];
-    while ((insn.bits() & p->mask) != p->match)
-      p++;
-    desc = *p;
-
-    if (p->mask != 0 && p > &instructions[0]) {
-      if (p->match != (p-1)->match && p->match != (p+1)->match) {
-        // move to front of opcode list to reduce miss penalty
-        while (--p >= &instructions[0])
-          *(p+1) = *p;
-        instructions[0] = desc;
-      }
-    }
+  insn_bits_t bits = insn.bits();
+  const decode_range_t* range = &decode_table[decode_key(bits)];
+  if (range->count == 0)
+    range = &decode_table[range->first + ((bits >> 25) & 0x7f)];
 
-    opcode_cache[idx] = desc;
-    opcode_cache[idx].match = insn.bits();
-  }
+  // every range ends with illegal_instruction, which matches anything
+  const insn_desc_t* p = &decode_insns[range->first];
+  while ((bits & p->mask) != p->match)
+    p++;
 
-  return xlen == 64 ? desc.rv64 : desc.rv32;
+  return xlen == 64 ? p->rv64 : p->rv32;
 }
 
 void processor_t::register_insn(insn_desc_t desc)
@@ -865,8 +946,34 @@ void processor_t::build_opcode_map()
   };
   std::sort(instructions.begin(), instructions.end(), cmp());
 
-  for (size_t i = 0; i < OPCODE_CACHE_SIZE; i++)
-    opcode_cache[i] = {0, 0, &illegal_instruction, &illegal_instruction};
+  decode_table.assign(DECODE_TABLE_SIZE, decode_range_t());
+  decode_insns.clear();
+  for (size_t key = 0; key < DECODE_TABLE_SIZE; key++) {
+    std::vector<const insn_desc_t*> candidates;
+    for (auto& insn : instructions)
+      if (((decode_key(insn.match) ^ key) & decode_key(insn.mask)) == 0)
+        candidates.push_back(&insn);
+
+    // The funct7 bits of compressed instructions are not part of their
+    // encoding, so only 32-bit ranges are worth splitting.
+    if ((key & 3) != 3 || candidates.size() <= DECODE_SPLIT_THRESHOLD) {
+      decode_table[key] = {uint32_t(decode_insns.size()), uint32_t(candidates.size())};
+      for (auto p : candidates)
+        decode_insns.push_back(*p);
+      continue;
+    }
+
+    size_t split = decode_table.size();
+    decode_table[key] = {uint32_t(split), 0};
+    decode_table.resize(split + 128);
+    for (size_t funct7 = 0; funct7 < 128; funct7++) {
+      size_t first = decode_insns.size();
+      for (auto p : candidates)
+        if ((((p->match >> 25) ^ funct7) & (p->mask >> 25) & 0x7f) == 0)
+          decode_insns.push_back(*p);
+      decode_table[split + funct7] = {uint32_t(first), uint32_t(decode_insns.size() - first)};
+    }
+  }
 }
 
 void processor_t::register_extension(extension_t* x)
@@ -21,6 +21,7 @@ class simif_t;
 class trap_t;
 class extension_t;
 class disassembler_t;
+class jit_t;
 
 struct insn_desc_t
 {
@@ -139,6 +140,11 @@ struct state_t
   uint32_t frm;
   bool serialized; // whether timer CSRs are in a well-defined state
 
+  // synchronous trap of the instruction that returned PC_PENDING_TRAP
+  reg_t pending_trap_cause;
+  reg_t pending_trap_tval;
+  reg_t pending_trap_epc;
+
   // When true, execute a single instruction and then enter debug mode.  This
   // can only be set by executing dret.
   enum {
@@ -174,17 +180,46 @@ static int cto(reg_t val)
 class processor_t : public abstract_device_t
 {
 public:
-  processor_t(const char* isa, simif_t* sim, uint32_t id, enclave_id_t e_id, page_tag_t *tag_directory, size_t num_of_pages, bool halt_on_reset=false);
+  processor_t(const char* isa, simif_t* sim, uint32_t id, enclave_id_t e_id, tag_directory_t *tag_directory, bool halt_on_reset=false);
   ~processor_t();
 
   enclave_id_t get_enclave_id() {return enclave_id;};
   void set_debug(bool value);
   void set_histogram(bool value);
+  void set_jit(bool value);
   void reset();
   void step(size_t n); // run for n cycles
+  // number of cycles of the last step left to run because the hart had to
+  // stop running concurrently, see mmu_t::begin_concurrent
+  size_t get_unfinished_steps() { return unfinished_steps; }
+  // whether the last step ended at a WFI and no interrupt has become
+  // pending since, so the hart would only wait if it ran
+  bool is_waiting() {
+    return stopped_at_wfi && !(state.mip & state.mie) && !halt_request &&
+           !debug && state.dcsr.cause == DCSR_CAUSE_NONE;
+  }
+  // make the hart run again after a WFI without an interrupt, e.g. because
+  // its mailbox got a message
+  void stop_waiting() { stopped_at_wfi = false; }
   void set_csr(int which, reg_t val);
   reg_t get_csr(int which);
+  // the same without throwing; legal is false if which cannot be read
+  reg_t get_csr(int which, bool* legal);
+  // Record a synchronous trap of the instruction at epc and return
+  // PC_PENDING_TRAP, for the instruction to return as its next pc. The step
+  // loop takes the trap as if it had been thrown, but without unwinding.
+  reg_t set_pending_trap(reg_t cause, reg_t tval, reg_t epc) {
+    state.pending_trap_cause = cause;
+    state.pending_trap_tval = tval;
+    state.pending_trap_epc = epc;
+    return PC_PENDING_TRAP;
+  }
+  // the same for the fault of the last failed mmu_t::*_or_fault access
+  reg_t set_pending_mem_fault(reg_t epc);
+  // add the flags of FP instructions run on the host to fflags
+  void take_host_fp_flags();
   mmu_t* get_mmu() { return mmu; }
+  jit_t* get_jit() { return jit; }
   state_t* get_state() { return &state; }
   unsigned get_xlen() { return xlen; }
   unsigned get_max_xlen() { return max_xlen; }
@@ -321,9 +356,11 @@ private:
   reg_t max_isa;
   std::string isa_string;
   bool histogram_enabled;
+  jit_t* jit; // translator of hot blocks, or NULL
+  size_t unfinished_steps;
+  bool stopped_at_wfi;
 
-  page_tag_t *tag_directory;
-  size_t num_of_pages;
+  tag_directory_t *tag_directory;
 
   bool halt_on_reset;
   enclave_id_t enclave_id;
@@ -331,12 +368,26 @@ private:
   std::vector<insn_desc_t> instructions;
   std::map<reg_t,uint64_t> pc_histogram;
 
-  static const size_t OPCODE_CACHE_SIZE = 8191;
-  insn_desc_t opcode_cache[OPCODE_CACHE_SIZE];
+  // Decode table, rebuilt from instructions whenever instructions are
+  // registered. The first level is indexed by decode_key(), i.e. the major
+  // opcode and bits 15:12, which hold funct3 of both 32-bit and compressed
+  // instructions. Ranges of 32-bit instructions with more candidates than
+  // DECODE_SPLIT_THRESHOLD are split again by funct7. Each range lists its
+  // candidates in priority order and ends with illegal_instruction.
+  struct decode_range_t {
+    uint32_t first; // index into decode_insns, or of the funct7 ranges
+    uint32_t count; // 0 if the range is split by funct7
+  };
+  static const size_t DECODE_TABLE_SIZE = 1 << 11;
+  static const size_t DECODE_SPLIT_THRESHOLD = 4;
+  static insn_bits_t decode_key(insn_bits_t bits) { return (bits & 0x7f) | ((bits >> 5) & 0x780); }
+  std::vector<decode_range_t> decode_table;
+  std::vector<insn_desc_t> decode_insns;
 
   void take_pending_interrupt() { take_interrupt(state.mip & state.mie); }
   void take_interrupt(reg_t mask); // take first enabled interrupt in mask
   void take_trap(trap_t& t, reg_t epc); // take an exception
+  void take_pending_trap(); // take the trap set by set_pending_trap()
   void disasm(insn_t insn); // disassemble and print an instruction
   int paddr_bits();
 
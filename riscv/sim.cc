@@ -6,10 +6,14 @@
 #include "dts.h"
 #include "remote_bitbang.h"
 #include "encoding.h"
+#include "extension.h"
+#include "jit.h"
 #include <map>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <climits>
+#include <cinttypes>
 #include <cstdlib>
 #include <cassert>
 #include <signal.h>
@@ -52,15 +56,57 @@ void sim_t::output_stats(reg_t label)
   fprintf(stat_log, "\n");
 }
 
+void sim_t::output_sim_stats()
+{
+  if (!sim_stats_enabled)
+    return;
+
+  fprintf(stat_log, "\n>>>>>SIM_STATS<<<<<\n");
+  fprintf(stat_log, "hart, tlb entries, tlb ways, tlb hits, tlb misses, tlb refills, page walks, walk cache hits\n");
+  for (size_t i = 0; i < procs.size(); i++) {
+    mmu_t* mmu = procs[i]->get_mmu();
+    const tlb_stats_t& tlb = mmu->get_tlb_stats();
+    fprintf(stat_log, "%zu, %zu, %zu, %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 "\n",
+        i, mmu->get_tlb_entries(), mmu->get_tlb_ways(),
+        tlb.hits, tlb.misses, tlb.refills, tlb.walks, tlb.walk_cache_hits);
+  }
+  fprintf(stat_log, "memory base, memory size, resident bytes\n");
+  for (auto& x : mems) {
+    fprintf(stat_log, "0x%" PRIx64 ", %zu, %zu\n",
+        x.first, x.second->size(), x.second->resident_size());
+  }
+  if (decode_cache) {
+    const decode_cache_stats_t& decode = decode_cache->get_stats();
+    fprintf(stat_log, "decode cache entries, decode cache hits, decode cache misses\n");
+    fprintf(stat_log, "%zu, %" PRIu64 ", %" PRIu64 "\n",
+        decode_cache->size(), decode.hits, decode.misses);
+  }
+  if (procs.size() > 0 && procs[0]->get_jit()) {
+    fprintf(stat_log, "hart, jit blocks, jit instructions, jit flushes\n");
+    for (size_t i = 0; i < procs.size(); i++) {
+      const jit_stats_t& jit = procs[i]->get_jit()->get_stats();
+      fprintf(stat_log, "%zu, %" PRIu64 ", %" PRIu64 ", %" PRIu64 "\n",
+          i, jit.translated_blocks, jit.translated_insns, jit.flushes);
+    }
+  }
+  fprintf(stat_log, "idle rtc ticks skipped\n");
+  fprintf(stat_log, "%" PRIu64 "\n", idle_ticks);
+  if (mailbox) {
+    fprintf(stat_log, "mailbox loads, mailbox stores, mailbox invalidations\n");
+    fprintf(stat_log, "%" PRIu64 ", %" PRIu64 ", %" PRIu64 "\n",
+        mailbox->get_loads(), mailbox->get_stores(), mailbox->get_invalidations());
+  }
+  fflush(stat_log);
+}
+
 void sim_t::request_halt(uint32_t id)
 {
-  static bool procRequests[64] = {false};
-  if(id >= 64) exit(-1);
-  procRequests[id] = true;
+  if(id >= procs.size()) exit(-1);
+  exit_requested[id] = true;
 
   for(unsigned int i = 0; i < procs.size(); i++)
   {
-    if(!procRequests[i]) {
+    if(!exit_requested[i]) {
       if(i != 1) {//TODO remove this and just exit from the management code.
         return;
       }
@@ -71,6 +117,7 @@ void sim_t::request_halt(uint32_t id)
   {
     procs[i]->output_histogram();
   }
+  output_sim_stats();
   exit(0);
 }
 
@@ -80,8 +127,11 @@ sim_t::sim_t(const char* isa, size_t nprocs, size_t nenclaves, bool halted, reg_
              std::vector<int> const hartids, unsigned progsize,
              unsigned max_bus_master_bits, bool require_authentication, icache_sim_t **ics, dcache_sim_t **dcs, l2cache_sim_t *l2, l2cache_sim_t **rmts, l2cache_sim_t **static_llc, reg_t num_of_pages, FILE *_stat_log)
   : htif_t(args), mems(mems), procs(std::max(nprocs, size_t(1))), nenclaves(nenclaves),
-    start_pc(start_pc), current_step(0), current_proc(0), debug(false),
-    histogram_enabled(false), dtb_enabled(true), remote_bitbang(NULL),
+    start_pc(start_pc), quantum(INTERLEAVE), max_quantum(INTERLEAVE),
+    adaptive_quantum(false), last_shared_accesses(0),
+    current_step(0), current_proc(0), debug(false),
+    histogram_enabled(false), sim_stats_enabled(false), dtb_enabled(true), remote_bitbang(NULL),
+    concurrent(false), concurrent_round(0), busy_workers(0), stop_workers(false),
     debug_module(this, progsize, max_bus_master_bits, require_authentication), ics(ics), dcs(dcs), l2(l2), rmts(rmts), static_llc(static_llc)
 {
   signal(SIGINT, &handle_signal);
@@ -93,31 +143,29 @@ sim_t::sim_t(const char* isa, size_t nprocs, size_t nenclaves, bool halted, reg_
   }
 
   unaccounted_for_steps = 0;
+  exit_requested.assign(procs.size(), false);
+  idle_rounds = 0;
+  idle_ticks = 0;
 
-  tag_directory = new page_tag_t[num_of_pages];
-  for(reg_t i = 0; i < num_of_pages; i++)
-  {
-    tag_directory[i].owner = ENCLAVE_DEFAULT_ID;
-    tag_directory[i].reader = ENCLAVE_INVALID_ID;
-  }
+  tag_directory = new tag_directory_t(num_of_pages);
 
   for (auto& x : mems)
-    bus.add_device(x.first, x.second);
+    bus.add_mem(x.first, x.second);
 
   debug_module.add_device(&bus);
 
-  debug_mmu = new mmu_t(this, NULL, tag_directory, num_of_pages);
+  debug_mmu = new mmu_t(this, NULL, tag_directory);
 
   if (hartids.size() == 0)
   {
     for (size_t i = 0; i < procs.size() - nenclaves; i++)
     {
-      procs[i] = new processor_t(isa, this, i, ENCLAVE_DEFAULT_ID, tag_directory, num_of_pages, halted);
+      procs[i] = new processor_t(isa, this, i, ENCLAVE_DEFAULT_ID, tag_directory, halted);
     }
     enclave_id_t current_id = 1;
     for (size_t i = procs.size() - nenclaves; i < procs.size(); i++)
     {
-      procs[i] = new processor_t(isa, this, i, current_id, tag_directory, num_of_pages, halted);
+      procs[i] = new processor_t(isa, this, i, current_id, tag_directory, halted);
       current_id += 1;
     }
   }
@@ -132,13 +180,28 @@ sim_t::sim_t(const char* isa, size_t nprocs, size_t nenclaves, bool halted, reg_
 
   clint.reset(new clint_t(procs));
   bus.add_device(CLINT_BASE, clint.get());
+
+#ifdef MANAGEMENT_SHIM_INSTRUCTIONS
+  if (nenclaves > 0) {
+    mailbox.reset(new mailbox_t(procs.size()));
+    bus.add_device(MAILBOX_BASE, mailbox.get());
+  }
+#endif //MANAGEMENT_SHIM_INSTRUCTIONS
 }
 
 sim_t::~sim_t()
 {
+  {
+    std::lock_guard<std::mutex> lock(workers_mutex);
+    stop_workers = true;
+  }
+  workers_start.notify_all();
+  for (auto& worker : workers)
+    worker.join();
   for (size_t i = 0; i < procs.size(); i++)
     delete procs[i];
   delete debug_mmu;
+  delete tag_directory;
 }
 
 void sim_t::process_enclave_read_access(reg_t paddr, enclave_id_t writer_id, enclave_id_t reader_id) {
@@ -182,8 +245,10 @@ void sim_t::main()
   {
     if (debug || ctrlc_pressed)
       interactive();
+    else if (concurrent && current_step == 0 && current_proc == 0)
+      step_concurrent();
     else
-      step(INTERLEAVE);
+      step(quantum);
     if (remote_bitbang) {
       remote_bitbang->tick();
     }
@@ -199,37 +264,208 @@ int sim_t::run()
 #endif
 
   fprintf(stat_log, "label, instruction count (core 0), privileged instruction count (core 0), cache stats ...\n");
-  return htif_t::run();
+  int exit_code = htif_t::run();
+  output_sim_stats();
+  return exit_code;
 }
 
 void sim_t::step(size_t n)
 {
   for (size_t i = 0, steps = 0; i < n; i += steps)
   {
-    steps = std::min(n - i, INTERLEAVE - current_step);
-    if (current_proc < procs.size()) {
+    steps = std::min(n - i, quantum - current_step);
+    bool runnable = current_proc < procs.size() && hart_runnable(current_proc);
+    if (runnable) {
       procs[current_proc]->step(steps);
     }
 
     current_step += steps;
-    if (current_step == INTERLEAVE)
+    if (current_step == quantum)
     {
       current_step = 0;
       procs[current_proc]->get_mmu()->yield_load_reservation();
 
-      if (++current_proc == procs.size()) {
+      bool round_done = ++current_proc == procs.size();
+      if (round_done) {
         current_proc = 0;
-        clint->increment(INTERLEAVE / INSNS_PER_RTC_TICK);
-        unaccounted_for_steps += INTERLEAVE % INSNS_PER_RTC_TICK;
-        if(unaccounted_for_steps >= INSNS_PER_RTC_TICK) {
-            clint->increment(1);
-            unaccounted_for_steps -= INSNS_PER_RTC_TICK;
-        }
+        advance_rtc();
+        adapt_quantum();
       }
 
-      host->switch_to();
+      // a skipped hart did nothing the host has to see
+      if (runnable || round_done)
+        host->switch_to();
+    }
+  }
+}
+
+// Whether stepping the hart can change anything. Harts that wait for an
+// interrupt, are parked in the debug ROM or have asked to exit are left out
+// of the rounds until an interrupt, a mailbox message or a debugger command
+// makes them runnable again; the checks look at the live state, so there is
+// nothing to update when that happens.
+bool sim_t::hart_runnable(size_t i)
+{
+  return !exit_requested[i] && !procs[i]->is_waiting() &&
+         !debug_module.hart_parked(i);
+}
+
+void sim_t::advance_rtc()
+{
+  clint->increment(quantum / INSNS_PER_RTC_TICK);
+  unaccounted_for_steps += quantum % INSNS_PER_RTC_TICK;
+  if(unaccounted_for_steps >= INSNS_PER_RTC_TICK) {
+      clint->increment(1);
+      unaccounted_for_steps -= INSNS_PER_RTC_TICK;
+  }
+  skip_idle_time();
+}
+
+// When no hart is runnable, the rounds until the next timer interrupt would
+// only run idle loops, so mtime jumps straight to it. Harts have to have
+// been waiting for two rounds in a row, so that each of them has seen what
+// the others did before they started to wait. Without a timer interrupt to
+// jump to, e.g. when the harts wait for HTIF or the debugger, the rounds are
+// simulated as usual.
+void sim_t::skip_idle_time()
+{
+  for (size_t i = 0; i < procs.size(); i++) {
+    if (hart_runnable(i)) {
+      idle_rounds = 0;
+      return;
     }
   }
+  if (++idle_rounds < 2)
+    return;
+
+  reg_t deadline = clint->get_next_deadline();
+  if (deadline == reg_t(-1))
+    return;
+  reg_t ticks = deadline - clint->get_mtime();
+  clint->increment(ticks);
+  idle_ticks += ticks;
+  idle_rounds = 0;
+}
+
+// Run one round of quantum steps per hart, like step() does, but with the
+// harts of different enclaves running at the same time. Harts that share an
+// enclave may share pages, so they run one after the other on the same
+// thread. Until a hart touches state it shares with other harts its steps
+// only depend on pages its enclave owns, which no other thread can write.
+// At that point it stops, and once all threads are done the stopped harts
+// finish their steps in hart order. The outcome of a round is thus the same
+// as if the harts had run in turn, and runs are repeatable. Harts that are
+// not runnable when the round starts sit it out.
+void sim_t::step_concurrent()
+{
+  std::map<enclave_id_t, size_t> group_of;
+  std::vector<bool> runnable(procs.size());
+  concurrent_groups.clear();
+  for (size_t i = 0; i < procs.size(); i++) {
+    runnable[i] = hart_runnable(i);
+    if (!runnable[i])
+      continue;
+    auto it = group_of.find(procs[i]->get_enclave_id());
+    if (it == group_of.end()) {
+      it = group_of.insert(std::make_pair(procs[i]->get_enclave_id(), concurrent_groups.size())).first;
+      concurrent_groups.emplace_back();
+    }
+    concurrent_groups[it->second].push_back(procs[i]);
+    procs[i]->get_mmu()->begin_concurrent(procs[i]->get_enclave_id());
+  }
+
+  next_concurrent_group = 0;
+  {
+    std::lock_guard<std::mutex> lock(workers_mutex);
+    concurrent_round++;
+    busy_workers = workers.size();
+  }
+  workers_start.notify_all();
+  run_concurrent_groups();
+  {
+    std::unique_lock<std::mutex> lock(workers_mutex);
+    workers_done.wait(lock, [this]{ return busy_workers == 0; });
+  }
+
+  for (size_t i = 0; i < procs.size(); i++) {
+    if (runnable[i])
+      procs[i]->get_mmu()->end_concurrent();
+  }
+  for (size_t i = 0; i < procs.size(); i++) {
+    if (!runnable[i])
+      continue;
+    if (size_t steps = procs[i]->get_unfinished_steps())
+      procs[i]->step(steps);
+    procs[i]->get_mmu()->yield_load_reservation();
+  }
+
+  advance_rtc();
+  adapt_quantum();
+  host->switch_to();
+}
+
+void sim_t::run_concurrent_groups()
+{
+  for (size_t group; (group = next_concurrent_group++) < concurrent_groups.size(); ) {
+    for (processor_t* proc : concurrent_groups[group])
+      proc->step(quantum);
+  }
+}
+
+void sim_t::concurrent_worker()
+{
+  size_t round = 0;
+  std::unique_lock<std::mutex> lock(workers_mutex);
+  while (true) {
+    workers_start.wait(lock, [&]{ return stop_workers || concurrent_round != round; });
+    if (stop_workers)
+      return;
+    round = concurrent_round;
+    lock.unlock();
+    run_concurrent_groups();
+    lock.lock();
+    if (--busy_workers == 0)
+      workers_done.notify_one();
+  }
+}
+
+void sim_t::set_concurrent(bool value)
+{
+  concurrent = value;
+  if (!value || !workers.empty())
+    return;
+  // the simulation thread runs groups as well
+  size_t threads = std::min<size_t>(procs.size(), std::max(1u, std::thread::hardware_concurrency()));
+  for (size_t i = 1; i < threads; i++)
+    workers.emplace_back(&sim_t::concurrent_worker, this);
+}
+
+void sim_t::set_quantum(size_t n, bool adaptive)
+{
+  if (n)
+    quantum = max_quantum = n;
+  adaptive_quantum = adaptive;
+}
+
+// Halve the quantum after a round in which harts communicated, so that they
+// see each other's messages and stores sooner, and double it again up to the
+// configured quantum after a round in which they did not, so that less time
+// goes to switching between harts and giving up load reservations.
+void sim_t::adapt_quantum()
+{
+  if (!adaptive_quantum)
+    return;
+
+  uint64_t shared_accesses = mailbox ? mailbox->get_loads() + mailbox->get_stores() : 0;
+  for (size_t i = 0; i < procs.size(); i++)
+    shared_accesses += procs[i]->get_mmu()->get_shared_accesses();
+  bool communicated = shared_accesses != last_shared_accesses;
+  last_shared_accesses = shared_accesses;
+
+  if (communicated)
+    quantum = std::max(std::max<size_t>(max_quantum / ADAPTIVE_QUANTUM_RANGE, 1), quantum / 2);
+  else
+    quantum = std::min(max_quantum, quantum * 2);
 }
 
 void sim_t::set_debug(bool value)
@@ -250,6 +486,64 @@ void sim_t::set_histogram(bool value)
   }
 }
 
+void sim_t::set_sim_stats(bool value)
+{
+  sim_stats_enabled = value;
+}
+
+void sim_t::set_sim_tlb(size_t entries, size_t ways)
+{
+  for (size_t i = 0; i < procs.size(); i++) {
+    procs[i]->get_mmu()->set_tlb_geometry(entries, ways);
+  }
+}
+
+void sim_t::set_jit(bool value)
+{
+  for (size_t i = 0; i < procs.size(); i++) {
+    procs[i]->set_jit(value);
+  }
+}
+
+void sim_t::set_shared_decode_cache(size_t entries)
+{
+  decode_cache.reset(new decode_cache_t(entries));
+
+  // Harts decode identically if they have the same ISA and extension.
+  std::vector<std::string> classes;
+  for (size_t i = 0; i < procs.size(); i++) {
+    extension_t* ext = procs[i]->get_extension();
+    std::string config = procs[i]->get_isa_string() + ":" + (ext ? ext->name() : "");
+    size_t decode_class = std::find(classes.begin(), classes.end(), config) - classes.begin();
+    if (decode_class == classes.size())
+      classes.push_back(config);
+    procs[i]->get_mmu()->set_decode_cache(decode_cache.get(), decode_class);
+  }
+}
+
+void sim_t::code_page_cached(reg_t ppn)
+{
+  if (code_pages[ppn]++ != 0)
+    return;
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->get_mmu()->drop_store_translations(ppn);
+  debug_mmu->drop_store_translations(ppn);
+}
+
+void sim_t::code_page_released(reg_t ppn)
+{
+  auto it = code_pages.find(ppn);
+  assert(it != code_pages.end());
+  if (--it->second == 0)
+    code_pages.erase(it);
+}
+
+void sim_t::code_page_written(reg_t ppn)
+{
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->get_mmu()->code_page_written(ppn);
+}
+
 void sim_t::set_procs_debug(bool value)
 {
   for (size_t i = 0; i < procs.size(); i++) {
@@ -271,6 +565,30 @@ bool sim_t::mmio_store(reg_t addr, size_t len, const uint8_t* bytes)
   return bus.store(addr, len, bytes);
 }
 
+bool sim_t::mmio_hart_load(reg_t addr, size_t len, uint8_t* bytes, uint32_t hart_id, enclave_id_t enclave_id)
+{
+  if (addr + len < addr)
+    return false;
+  return bus.hart_load(addr, len, bytes, hart_id, enclave_id);
+}
+
+bool sim_t::mmio_hart_store(reg_t addr, size_t len, const uint8_t* bytes, uint32_t hart_id, enclave_id_t enclave_id)
+{
+  if (addr + len < addr)
+    return false;
+  if (!bus.hart_store(addr, len, bytes, hart_id, enclave_id))
+    return false;
+#ifdef MANAGEMENT_SHIM_INSTRUCTIONS
+  // The message may be what a hart in WFI is waiting for. Messages do not
+  // raise interrupts, so all waiting harts get to look.
+  if (mailbox && addr >= MAILBOX_BASE && addr < MAILBOX_BASE + MAILBOX_SIZE) {
+    for (size_t i = 0; i < procs.size(); i++)
+      procs[i]->stop_waiting();
+  }
+#endif //MANAGEMENT_SHIM_INSTRUCTIONS
+  return true;
+}
+
 void sim_t::make_dtb()
 {
   const int reset_vec_size = 8;
@@ -335,16 +653,19 @@ void sim_t::make_dtb()
 }
 
 char* sim_t::addr_to_mem(reg_t addr) {
-  auto desc = bus.find_device(addr);
-  auto mem = dynamic_cast<mem_t*>(desc.second);
-  if (mem) {
-    if (addr - desc.first < mem->size()) {
-      return mem->contents() + (addr - desc.first);
-    }
-  }
+  bus_region_t region = bus.find_region(addr);
+  if (region.is_ram())
+    return region.mem + (addr - region.base);
   return NULL;
 }
 
+bus_region_t sim_t::find_mem_region(reg_t addr) {
+  bus_region_t region = bus.find_region(addr);
+  if (region.is_ram())
+    return region;
+  return {0, 0, NULL, NULL};
+}
+
 // htif
 
 void sim_t::reset()
@@ -358,22 +679,67 @@ void sim_t::idle()
   target.switch_to();
 }
 
+char* sim_t::htif_page_to_mem(reg_t paddr, size_t len, bool store)
+{
+  bus_region_t region = find_mem_region(paddr);
+  if (!region.is_ram() || !region.contains(paddr + len - 1))
+    return NULL;
+  // The host may only touch DRAM pages that it could access as the default
+  // enclave; anything else goes through the MMU, which raises the fault.
+  if (paddr >= DRAM_BASE && paddr < DRAM_BASE + PGSIZE * tag_directory->size()) {
+    const page_tag_t& tag = tag_directory->get((paddr - DRAM_BASE) / PGSIZE);
+    if (tag.owner != ENCLAVE_DEFAULT_ID && (store || tag.reader != ENCLAVE_DEFAULT_ID))
+      return NULL;
+  }
+  return region.mem + (paddr - region.base);
+}
+
 void sim_t::read_chunk(addr_t taddr, size_t len, void* dst)
 {
-  assert(len == 8);
-  auto data = debug_mmu->load_uint64(taddr, ENCLAVE_DEFAULT_ID);
-  memcpy(dst, &data, sizeof data);
+  assert(len % 8 == 0 && taddr % 8 == 0);
+  char* dst_bytes = (char*)dst;
+  while (len) {
+    size_t n = std::min(len, size_t(PGSIZE - (taddr % PGSIZE)));
+    if (char* mem = htif_page_to_mem(taddr, n, false)) {
+      memcpy(dst_bytes, mem, n);
+    } else {
+      for (size_t i = 0; i < n; i += 8) {
+        auto data = debug_mmu->load_uint64(taddr + i, ENCLAVE_DEFAULT_ID);
+        memcpy(dst_bytes + i, &data, sizeof data);
+      }
+    }
+    taddr += n;
+    dst_bytes += n;
+    len -= n;
+  }
 }
 
 void sim_t::write_chunk(addr_t taddr, size_t len, const void* src)
 {
-  assert(len == 8);
-  uint64_t data;
-  memcpy(&data, src, sizeof data);
-  debug_mmu->store_uint64(taddr, data, ENCLAVE_DEFAULT_ID);
+  assert(len % 8 == 0 && taddr % 8 == 0);
+  const char* src_bytes = (const char*)src;
+  while (len) {
+    size_t n = std::min(len, size_t(PGSIZE - (taddr % PGSIZE)));
+    if (char* mem = htif_page_to_mem(taddr, n, true)) {
+      memcpy(mem, src_bytes, n);
+      if (is_code_page(taddr >> PGSHIFT))
+        code_page_written(taddr >> PGSHIFT);
+    } else {
+      for (size_t i = 0; i < n; i += 8) {
+        uint64_t data;
+        memcpy(&data, src_bytes + i, sizeof data);
+        debug_mmu->store_uint64(taddr + i, data, ENCLAVE_DEFAULT_ID);
+      }
+    }
+    taddr += n;
+    src_bytes += n;
+    len -= n;
+  }
 }
 
 void sim_t::proc_reset(unsigned id)
 {
   debug_module.proc_reset(id);
+  if (clint)
+    clint->hart_reset(id);
 }
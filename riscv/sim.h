@@ -9,11 +9,17 @@
 #include "debug_module.h"
 #include "simif.h"
 #include "cachesim.h"
+#include "decode_cache.h"
 #include <fesvr/htif.h>
 #include <fesvr/context.h>
 #include <vector>
 #include <string>
 #include <memory>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include "debug.h"
 
 #define STACK_PAGE_OFFSET 4096
@@ -35,9 +41,24 @@ public:
   int run();
   void request_halt(uint32_t id);
   void output_stats(reg_t label=0);
+  void output_sim_stats();
   void set_debug(bool value);
   void set_log(bool value);
   void set_histogram(bool value);
+  void set_sim_stats(bool value);
+  void set_sim_tlb(size_t entries, size_t ways);
+  // Let all harts share one decoded-instruction store of the given size.
+  // Call after extensions have been registered.
+  void set_shared_decode_cache(size_t entries);
+  // Translate hot blocks to host code, see jit_t::supported().
+  void set_jit(bool value);
+  // Run the harts of different enclaves on separate host threads, see
+  // step_concurrent(). Not for use with debugging, logging or cache models.
+  void set_concurrent(bool value);
+  // Run each hart for n steps at a time, or INTERLEAVE if n is 0. If
+  // adaptive, n is only the upper bound and the quantum shrinks while harts
+  // communicate, see adapt_quantum().
+  void set_quantum(size_t n, bool adaptive);
   void set_procs_debug(bool value);
   void set_dtb_enabled(bool value) {
     this->dtb_enabled = value;
@@ -60,16 +81,21 @@ private:
   std::vector<std::pair<reg_t, mem_t*>> mems;
   mmu_t* debug_mmu;  // debug port into main memory
   std::vector<processor_t*> procs;
+  std::vector<bool> exit_requested; // by each hart through CSR_BAREMETALEXIT
   size_t nenclaves;
   reg_t start_pc;
   std::string dts;
   std::unique_ptr<rom_device_t> boot_rom;
   std::unique_ptr<rom_device_t> enclave_rom;
   std::unique_ptr<clint_t> clint;
+  std::unique_ptr<mailbox_t> mailbox;
+  std::unique_ptr<decode_cache_t> decode_cache;
   bus_t bus;
   FILE *stat_log = stdout;
 
   size_t unaccounted_for_steps;
+  size_t idle_rounds; // consecutive rounds after which all harts were waiting
+  reg_t idle_ticks; // ticks mtime skipped while all harts were waiting
 
   processor_t* get_core(const std::string& i);
   void step(size_t n); // step through simulation
@@ -78,23 +104,59 @@ private:
 #else //PRAESIDIO_DEBUG
   static const size_t INTERLEAVE = 5000;
 #endif //PRAESIDIO_DEBUG
+  // the adaptive quantum is at least the maximum quantum divided by this
+  static const size_t ADAPTIVE_QUANTUM_RANGE = 64;
   static const size_t INSNS_PER_RTC_TICK = 100; // 10 MHz clock for 1 BIPS core
   static const size_t CPU_HZ = 1000000000; // 1GHz CPU
+  size_t quantum; // steps per hart per round, INTERLEAVE by default
+  size_t max_quantum;
+  bool adaptive_quantum;
+  uint64_t last_shared_accesses; // communication seen up to the last round
   size_t current_step;
   size_t current_proc;
   bool debug;
   bool log;
   bool histogram_enabled; // provide a histogram of PCs
+  bool sim_stats_enabled; // report simulator-internal counters on exit
   bool dtb_enabled;
   remote_bitbang_t* remote_bitbang;
-  page_tag_t *tag_directory;
+  tag_directory_t *tag_directory;
+
+  // concurrent execution of harts
+  bool concurrent;
+  std::vector<std::vector<processor_t*>> concurrent_groups;
+  std::atomic<size_t> next_concurrent_group;
+  std::vector<std::thread> workers;
+  std::mutex workers_mutex;
+  std::condition_variable workers_start;
+  std::condition_variable workers_done;
+  size_t concurrent_round;
+  size_t busy_workers;
+  bool stop_workers;
+  void step_concurrent();
+  void run_concurrent_groups();
+  void concurrent_worker();
+  void advance_rtc(); // advance the real-time clock by one round of steps
+  void skip_idle_time();
+  bool hart_runnable(size_t i);
+  void adapt_quantum();
 
   // memory-mapped I/O routines
   char* addr_to_mem(reg_t addr);
+  bus_region_t find_mem_region(reg_t addr);
   bool mmio_load(reg_t addr, size_t len, uint8_t* bytes);
   bool mmio_store(reg_t addr, size_t len, const uint8_t* bytes);
+  bool mmio_hart_load(reg_t addr, size_t len, uint8_t* bytes, uint32_t hart_id, enclave_id_t enclave_id);
+  bool mmio_hart_store(reg_t addr, size_t len, const uint8_t* bytes, uint32_t hart_id, enclave_id_t enclave_id);
   void make_dtb();
 
+  // number of harts holding decoded instructions from each physical page
+  std::map<reg_t, size_t> code_pages;
+  void code_page_cached(reg_t ppn);
+  void code_page_released(reg_t ppn);
+  bool is_code_page(reg_t ppn) { return !code_pages.empty() && code_pages.count(ppn); }
+  void code_page_written(reg_t ppn);
+
   // presents a prompt for introspection into the simulation
   void interactive();
 
@@ -132,7 +194,10 @@ private:
   void read_chunk(addr_t taddr, size_t len, void* dst);
   void write_chunk(addr_t taddr, size_t len, const void* src);
   size_t chunk_align() { return 8; }
-  size_t chunk_max_size() { return 8; }
+  size_t chunk_max_size() { return 1 << 20; }
+  // host pointer for an HTIF access of len bytes within one page, or NULL
+  // if the access has to go through the debug MMU
+  char* htif_page_to_mem(reg_t paddr, size_t len, bool store);
 
 public:
   // Initialize this after procs, because in debug_module_t::reset() we
@@ -5,6 +5,7 @@
 
 #include "enclave.h"
 #include "decode.h"
+#include "devices.h"
 
 // this is the interface to the simulator used by the processors and memory
 class simif_t
@@ -12,11 +13,23 @@ class simif_t
 public:
   // should return NULL for MMIO addresses
   virtual char* addr_to_mem(reg_t addr) = 0;
+  // returns the RAM region containing addr, or an empty region for MMIO
+  virtual bus_region_t find_mem_region(reg_t addr) = 0;
   // used for MMIO addresses
   virtual bool mmio_load(reg_t addr, size_t len, uint8_t* bytes) = 0;
   virtual bool mmio_store(reg_t addr, size_t len, const uint8_t* bytes) = 0;
+  // MMIO accesses issued by a hart, for devices that depend on the initiator
+  virtual bool mmio_hart_load(reg_t addr, size_t len, uint8_t* bytes, uint32_t hart_id, enclave_id_t enclave_id) = 0;
+  virtual bool mmio_hart_store(reg_t addr, size_t len, const uint8_t* bytes, uint32_t hart_id, enclave_id_t enclave_id) = 0;
   // Callback for processors to let the simulation know they were reset.
   virtual void proc_reset(unsigned id) = 0;
+  // Track the physical pages that harts hold decoded instructions from.
+  // code_page_cached and code_page_released are called once per hart and
+  // page; code_page_written must be called for every store to a code page.
+  virtual void code_page_cached(reg_t ppn) = 0;
+  virtual void code_page_released(reg_t ppn) = 0;
+  virtual bool is_code_page(reg_t ppn) = 0;
+  virtual void code_page_written(reg_t ppn) = 0;
   // Praesidio specific calls
   virtual void request_halt(uint32_t id) = 0;
   virtual void output_stats(reg_t label=0) = 0;
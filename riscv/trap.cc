@@ -13,3 +13,39 @@ const char* trap_t::name()
   }
   return _name;
 }
+
+const char* pending_trap_t::name()
+{
+  switch (cause()) {
+    case CAUSE_MISALIGNED_FETCH: return "trap_instruction_address_misaligned";
+    case CAUSE_FETCH_ACCESS: return "trap_instruction_access_fault";
+    case CAUSE_ILLEGAL_INSTRUCTION: return "trap_illegal_instruction";
+    case CAUSE_BREAKPOINT: return "trap_breakpoint";
+    case CAUSE_MISALIGNED_LOAD: return "trap_load_address_misaligned";
+    case CAUSE_MISALIGNED_STORE: return "trap_store_address_misaligned";
+    case CAUSE_LOAD_ACCESS: return "trap_load_access_fault";
+    case CAUSE_STORE_ACCESS: return "trap_store_access_fault";
+    case CAUSE_USER_ECALL: return "trap_user_ecall";
+    case CAUSE_SUPERVISOR_ECALL: return "trap_supervisor_ecall";
+    case CAUSE_HYPERVISOR_ECALL: return "trap_hypervisor_ecall";
+    case CAUSE_MACHINE_ECALL: return "trap_machine_ecall";
+    case CAUSE_FETCH_PAGE_FAULT: return "trap_instruction_page_fault";
+    case CAUSE_LOAD_PAGE_FAULT: return "trap_load_page_fault";
+    case CAUSE_STORE_PAGE_FAULT: return "trap_store_page_fault";
+    default: return trap_t::name();
+  }
+}
+
+bool pending_trap_t::has_tval()
+{
+  // like the trap classes, only ecalls have no tval
+  switch (cause()) {
+    case CAUSE_USER_ECALL:
+    case CAUSE_SUPERVISOR_ECALL:
+    case CAUSE_HYPERVISOR_ECALL:
+    case CAUSE_MACHINE_ECALL:
+      return false;
+    default:
+      return true;
+  }
+}
@@ -32,6 +32,20 @@ class mem_trap_t : public trap_t
   reg_t tval;
 };
 
+// A trap an instruction set with processor_t::set_pending_trap() instead of
+// throwing it
+class pending_trap_t : public trap_t
+{
+ public:
+  pending_trap_t(reg_t which, reg_t tval)
+    : trap_t(which), tval(tval) {}
+  const char* name() override;
+  bool has_tval() override;
+  reg_t get_tval() override { return tval; }
+ private:
+  reg_t tval;
+};
+
 #define DECLARE_TRAP(n, x) class trap_##x : public trap_t { \
  public: \
   trap_##x() : trap_t(n) {} \
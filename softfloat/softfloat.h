@@ -50,9 +50,19 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdint.h>
 #include "softfloat_types.h"
 
+/*----------------------------------------------------------------------------
+| The rounding mode and exception flags below are kept per host thread, so
+| that harts simulated on different threads do not share them. Spike links
+| this library at startup, which allows the initial-exec TLS model and keeps
+| accesses as cheap as those of plain globals.
+*----------------------------------------------------------------------------*/
 #ifndef THREAD_LOCAL
+#if defined(__GNUC__)
+#define THREAD_LOCAL __thread __attribute__((tls_model("initial-exec")))
+#else
 #define THREAD_LOCAL
 #endif
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -6,6 +6,7 @@
 #include "remote_bitbang.h"
 #include "cachesim.h"
 #include "extension.h"
+#include "jit.h"
 #include <dlfcn.h>
 #include <fesvr/option_parser.h>
 #include <stdio.h>
@@ -37,6 +38,18 @@ static void help()
   fprintf(stderr, "  --l2=<S>:<W>:<B>        B both powers of 2).\n");
   fprintf(stderr, "  --l2_partitioning=<n> 0 is no partitioning, 1 is flexible partitioning\n");
   fprintf(stderr, "                          and 2 is static partitioning\n");
+  fprintf(stderr, "  --sim-tlb=<E>:<W>     Simulator TLB with E entries and W ways per hart\n");
+  fprintf(stderr, "                          (both powers of 2) [default 256:1]\n");
+  fprintf(stderr, "  --shared-decode=<E>   Share a decoded-instruction cache of E entries\n");
+  fprintf(stderr, "                          (a power of 2) between all harts\n");
+  fprintf(stderr, "  --jit                 Translate hot blocks of RV64 code to x86-64 host code\n");
+  fprintf(stderr, "  --parallel            Run the harts of different enclaves on separate host\n");
+  fprintf(stderr, "                          threads (not with -d, -l or cache models)\n");
+  fprintf(stderr, "  --quantum=<n>         Run each hart for n instructions before switching\n");
+  fprintf(stderr, "                          to the next [default 5000]\n");
+  fprintf(stderr, "  --adaptive-quantum    Shrink the quantum while harts communicate and grow\n");
+  fprintf(stderr, "                          it back up to --quantum when they do not\n");
+  fprintf(stderr, "  --sim-stats           Report TLB, page-walk and resident memory stats on exit\n");
   fprintf(stderr, "  --extension=<name>    Specify RoCC Extension\n");
   fprintf(stderr, "  --enclave=<number>    Number of enclave threads to add [default 0]\n");
   fprintf(stderr, "  --manage-path=<path>  Path to management shim binary [default ../build/management.bin]\n");
@@ -51,6 +64,20 @@ static void help()
   exit(1);
 }
 
+static void parse_sim_tlb(const char* arg, size_t* entries, size_t* ways)
+{
+  char* p;
+  *entries = strtoull(arg, &p, 0);
+  *ways = 1;
+  if (*p == ':')
+    *ways = strtoull(p + 1, &p, 0);
+  if (*p != 0 || *entries == 0 || (*entries & (*entries - 1)) ||
+      *ways == 0 || (*ways & (*ways - 1)) || *ways > *entries) {
+    fprintf(stderr, "spike.cc: ERROR --sim-tlb must be of the form <entries>:<ways> with both powers of 2 and ways at most entries.\n");
+    exit(-1);
+  }
+}
+
 static std::vector<std::pair<reg_t, mem_t*>> make_mems(const char* arg, reg_t *num_of_pages, size_t num_enclaves, const char* management_path)
 {
   // handle legacy mem argument
@@ -66,7 +93,7 @@ static std::vector<std::pair<reg_t, mem_t*>> make_mems(const char* arg, reg_t *n
 
 #ifdef MANAGEMENT_SHIM_INSTRUCTIONS
     if (num_enclaves > 0) {
-      num_mems = 3; //DRAM, management shim and mailboxes
+      num_mems = 2; //DRAM and management shim; the mailboxes are a device
     }
 #endif
 #ifdef PRAESIDIO_DEBUG
@@ -105,18 +132,6 @@ static std::vector<std::pair<reg_t, mem_t*>> make_mems(const char* arg, reg_t *n
       size_t management_memory_size = MANAGEMENT_SHIM_SIZE + PGSIZE*num_enclaves; //We need to add extra pages for the stacks of the management code.
       memory_vector[1] = std::make_pair(reg_t(MANAGEMENT_SHIM_BASE), new mem_t(management_memory_size, file_size, management_array));
       free(management_array);
-
-      size_t mailbox_size = sizeof(struct Message_t)*(num_enclaves + 1);
-      int *mb_init = (int *) malloc(MAILBOX_SIZE);
-      for(unsigned int i = 0; i < MAILBOX_SIZE / (sizeof(int)); i++) {
-        mb_init[i] = -1;
-      }
-      //Round the size up to the nearest page
-      if(mailbox_size > MAILBOX_SIZE) {
-        fprintf(stderr, "spike.cc: ERROR mailbox size bigger than the memory.\n");
-        exit(-2);
-      }
-      memory_vector[2] = std::make_pair(reg_t(MAILBOX_BASE), new mem_t(MAILBOX_SIZE, (size_t) PGSIZE, (char *) mb_init));
     }
 #endif //MANAGEMENT_SHIM_INSTRUCTIONS
 #ifdef PRAESIDIO_DEBUG
@@ -152,6 +167,13 @@ int main(int argc, char** argv)
   bool debug = false;
   bool halted = false;
   bool histogram = false;
+  bool sim_stats = false;
+  size_t sim_tlb_entries = 0, sim_tlb_ways = 0;
+  size_t shared_decode_entries = 0;
+  bool jit = false;
+  bool parallel = false;
+  size_t quantum = 0;
+  bool adaptive_quantum = false;
   bool log = false;
   typedef uint64_t enclave_id_t;
   bool dump_dts = false;
@@ -216,6 +238,31 @@ int main(int argc, char** argv)
   parser.option(0, "l2", 1, [&](const char* s){llc_string = s;});
   parser.option(0, "l2_partitioning", 1, [&](const char* s){llc_partition_string = s;});
   parser.option(0, "isa", 1, [&](const char* s){isa = s;});
+  parser.option(0, "sim-tlb", 1, [&](const char* s){parse_sim_tlb(s, &sim_tlb_entries, &sim_tlb_ways);});
+  parser.option(0, "shared-decode", 1, [&](const char* s){
+    shared_decode_entries = strtoull(s, 0, 0);
+    if (shared_decode_entries == 0 || (shared_decode_entries & (shared_decode_entries - 1))) {
+      fprintf(stderr, "spike.cc: ERROR --shared-decode must be a power of 2.\n");
+      exit(-1);
+    }
+  });
+  parser.option(0, "jit", 0, [&](const char* s){
+    if (!jit_t::supported()) {
+      fprintf(stderr, "spike.cc: ERROR --jit is not supported on this host or with commit logging.\n");
+      exit(-1);
+    }
+    jit = true;
+  });
+  parser.option(0, "parallel", 0, [&](const char* s){parallel = true;});
+  parser.option(0, "quantum", 1, [&](const char* s){
+    quantum = strtoull(s, 0, 0);
+    if (quantum == 0) {
+      fprintf(stderr, "spike.cc: ERROR --quantum must be at least 1.\n");
+      exit(-1);
+    }
+  });
+  parser.option(0, "adaptive-quantum", 0, [&](const char* s){adaptive_quantum = true;});
+  parser.option(0, "sim-stats", 0, [&](const char* s){sim_stats = true;});
   parser.option(0, "extension", 1, [&](const char* s){extension = find_extension(s);});
   parser.option(0, "dump-dts", 0, [&](const char *s){dump_dts = true;});
   parser.option(0, "disable-dtb", 0, [&](const char *s){dtb_enabled = false;});
@@ -396,6 +443,22 @@ int main(int argc, char** argv)
   s.set_debug(debug);
   s.set_log(log);
   s.set_histogram(histogram);
+  s.set_sim_stats(sim_stats);
+  if (sim_tlb_entries)
+    s.set_sim_tlb(sim_tlb_entries, sim_tlb_ways);
+  if (shared_decode_entries)
+    s.set_shared_decode_cache(shared_decode_entries);
+  if (jit)
+    s.set_jit(jit);
+  if (quantum || adaptive_quantum)
+    s.set_quantum(quantum, adaptive_quantum);
+  if (parallel) {
+    if (debug || log || ic_string || dc_string || llc_string) {
+      fprintf(stderr, "spike.cc: ERROR --parallel cannot be combined with -d, -l or cache models.\n");
+      exit(-1);
+    }
+    s.set_concurrent(true);
+  }
 #ifdef PRAESIDIO_DEBUG
   struct Message_t msg;
   printf("spike.cc: message size is %lu bytes, type offset %ld, type size %lu\n", sizeof(struct Message_t), (long) ((long) &msg.type - (long) &msg), sizeof(enum MessageType_t));